@@ -37,6 +37,15 @@ __BEGIN_DECLS
  */
 typedef long dispatch_once_t;
 
+// dispatch_once_f() publishes the predicate with release semantics on Linux,
+// so the inline check loads it with acquire semantics there
+#if defined(__linux__) && defined(__ATOMIC_ACQUIRE)
+#define _dispatch_once_load(predicate) \
+		__atomic_load_n((predicate), __ATOMIC_ACQUIRE)
+#else
+#define _dispatch_once_load(predicate) (*(predicate))
+#endif
+
 /*!
  * @function dispatch_once
  *
@@ -64,7 +73,7 @@ DISPATCH_INLINE DISPATCH_ALWAYS_INLINE DISPATCH_NONNULL_ALL DISPATCH_NOTHROW
 void
 _dispatch_once(dispatch_once_t *predicate, dispatch_block_t block)
 {
-	if (DISPATCH_EXPECT(*predicate, ~0l) != ~0l) {
+	if (DISPATCH_EXPECT(_dispatch_once_load(predicate), ~0l) != ~0l) {
 		dispatch_once(predicate, block);
 	}
 }
@@ -84,7 +93,7 @@ void
 _dispatch_once_f(dispatch_once_t *predicate, void *context,
 		dispatch_function_t function)
 {
-	if (DISPATCH_EXPECT(*predicate, ~0l) != ~0l) {
+	if (DISPATCH_EXPECT(_dispatch_once_load(predicate), ~0l) != ~0l) {
 		dispatch_once_f(predicate, context, function);
 	}
 }
@@ -179,6 +179,118 @@ dispatch_async_f(dispatch_queue_t queue,
 	void *context,
 	dispatch_function_t work);
 
+/*!
+ * @function dispatch_async_inline_f
+ *
+ * @abstract
+ * Submits a function for asynchronous execution on a dispatch queue, along
+ * with a copy of its arguments.
+ *
+ * @discussion
+ * Like dispatch_async_f(), but instead of a context pointer owned by the
+ * caller, the function is passed a pointer to a private copy of the len bytes
+ * at args. Small argument structures are stored inside the work item itself,
+ * which avoids allocating and freeing a context for each submission. The copy
+ * is aligned to the size of a pointer and is only valid until the function
+ * returns.
+ *
+ * See dispatch_async_f() for details.
+ *
+ * @param queue
+ * The target dispatch queue to which the function is submitted.
+ * The system will hold a reference on the target queue until the function
+ * has returned.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @param work
+ * The application-defined function to invoke on the target queue. The first
+ * parameter passed to this function is a pointer to the copy of the arguments.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @param args
+ * The arguments to copy. May be NULL if len is zero.
+ *
+ * @param len
+ * The size of the arguments in bytes.
+ */
+DISPATCH_EXPORT DISPATCH_NONNULL1 DISPATCH_NONNULL2 DISPATCH_NOTHROW
+void
+dispatch_async_inline_f(dispatch_queue_t queue,
+	dispatch_function_t work,
+	const void *args,
+	size_t len);
+
+/*!
+ * @function dispatch_async_batch
+ *
+ * @abstract
+ * Submits an array of blocks for asynchronous execution on a dispatch queue.
+ *
+ * @discussion
+ * Equivalent to calling dispatch_async() for each block in array order, but
+ * the blocks are published on the queue in a single operation.
+ *
+ * See dispatch_async() for details.
+ *
+ * @param queue
+ * The target dispatch queue to which the blocks are submitted.
+ * The system will hold a reference on the target queue until the blocks
+ * have finished.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @param count
+ * The number of blocks in the array.
+ *
+ * @param blocks
+ * The blocks to submit to the target dispatch queue. This function performs
+ * Block_copy() and Block_release() on behalf of callers.
+ * The result of passing NULL in this parameter or as one of the blocks is
+ * undefined.
+ */
+#ifdef __BLOCKS__
+DISPATCH_EXPORT DISPATCH_NONNULL1 DISPATCH_NOTHROW
+void
+dispatch_async_batch(dispatch_queue_t queue,
+	size_t count,
+	dispatch_block_t const blocks[]);
+#endif
+
+/*!
+ * @function dispatch_async_batch_f
+ *
+ * @abstract
+ * Submits a function for asynchronous execution on a dispatch queue, once
+ * for each context in an array.
+ *
+ * @discussion
+ * See dispatch_async_batch() for details.
+ *
+ * @param queue
+ * The target dispatch queue to which the function is submitted.
+ * The system will hold a reference on the target queue until the function
+ * has returned for every context.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @param count
+ * The number of contexts in the array.
+ *
+ * @param contexts
+ * The application-defined context parameters to pass to the function, one
+ * per invocation.
+ *
+ * @param work
+ * The application-defined function to invoke on the target queue. The first
+ * parameter passed to this function is one of the contexts provided to
+ * dispatch_async_batch_f().
+ * The result of passing NULL in this parameter is undefined.
+ */
+DISPATCH_EXPORT DISPATCH_NONNULL1 DISPATCH_NONNULL4 DISPATCH_NOTHROW
+void
+dispatch_async_batch_f(dispatch_queue_t queue,
+	size_t count,
+	void *const contexts[],
+	dispatch_function_t work);
+
 /*!
  * @function dispatch_sync
  *
@@ -108,6 +108,80 @@ DISPATCH_EXPORT DISPATCH_NONNULL_ALL DISPATCH_NOTHROW
 long
 dispatch_semaphore_signal(dispatch_semaphore_t dsema);
 
+/*!
+ * @function dispatch_semaphore_wait_async_f
+ *
+ * @abstract
+ * Wait (decrement) for a semaphore without blocking the calling thread.
+ *
+ * @discussion
+ * Decrement the counting semaphore. If the resulting value is not less than
+ * zero, the function is submitted to the target queue right away. Otherwise
+ * it is recorded and submitted to the queue by the dispatch_semaphore_signal()
+ * call that would have woken a waiting thread, instead of a thread being
+ * parked until then. Asynchronous waiters are served before threads blocked
+ * in dispatch_semaphore_wait(), in FIFO order among themselves.
+ *
+ * The function does not signal the semaphore when it returns, this is up to
+ * the application.
+ *
+ * @param dsema
+ * The semaphore. The system will hold a reference on the semaphore until the
+ * function has been submitted.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @param queue
+ * The target dispatch queue to which the function is submitted.
+ * The system will hold a reference on the target queue until the function
+ * has returned.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @param context
+ * The application-defined context parameter to pass to the function.
+ *
+ * @param work
+ * The application-defined function to invoke on the target queue. The first
+ * parameter passed to this function is the context provided to
+ * dispatch_semaphore_wait_async_f().
+ * The result of passing NULL in this parameter is undefined.
+ */
+DISPATCH_EXPORT DISPATCH_NONNULL1 DISPATCH_NONNULL2 DISPATCH_NONNULL4
+DISPATCH_NOTHROW
+void
+dispatch_semaphore_wait_async_f(dispatch_semaphore_t dsema,
+	dispatch_queue_t queue,
+	void *context,
+	dispatch_function_t work);
+
+#ifdef __BLOCKS__
+/*!
+ * @function dispatch_semaphore_wait_async
+ *
+ * @abstract
+ * Wait (decrement) for a semaphore without blocking the calling thread.
+ *
+ * @discussion
+ * See dispatch_semaphore_wait_async_f() for details.
+ *
+ * @param dsema
+ * The semaphore.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @param queue
+ * The target dispatch queue to which the block is submitted.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @param block
+ * The block to submit once the semaphore has been decremented.
+ * The result of passing NULL in this parameter is undefined.
+ */
+DISPATCH_EXPORT DISPATCH_NONNULL_ALL DISPATCH_NOTHROW
+void
+dispatch_semaphore_wait_async(dispatch_semaphore_t dsema,
+	dispatch_queue_t queue,
+	dispatch_block_t block);
+#endif
+
 __END_DECLS
 
 #endif /* __DISPATCH_SEMAPHORE__ */
@@ -83,6 +83,252 @@ DISPATCH_EXPORT DISPATCH_NONNULL_ALL DISPATCH_NOTHROW
 void
 dispatch_queue_set_width(dispatch_queue_t dq, long width); // DEPRECATED
 
+/*!
+ * @function dispatch_queue_set_drain_quantum
+ *
+ * @abstract
+ * Bounds how much work a thread does on a queue before the queue yields the
+ * thread to the other queues sharing its target queue.
+ *
+ * @discussion
+ * When either limit is reached while items are still pending, the queue is
+ * pushed to the back of its target queue, so that queues sharing a target are
+ * serviced in round-robin order. The limits are checked between items, a long
+ * running item is never interrupted and at least one item runs per drain.
+ * By default there is no limit.
+ *
+ * @param queue
+ * The queue to adjust. Passing the main queue or a global concurrent queue
+ * will be ignored.
+ *
+ * @param items
+ * The number of items to invoke before yielding, or zero for no limit.
+ *
+ * @param nanoseconds
+ * The time to spend invoking items before yielding, or zero for no limit.
+ */
+DISPATCH_EXPORT DISPATCH_NONNULL_ALL DISPATCH_NOTHROW
+void
+dispatch_queue_set_drain_quantum(dispatch_queue_t queue, unsigned long items,
+		uint64_t nanoseconds);
+
+/*!
+ * @function dispatch_queue_attr_make_with_weight
+ *
+ * @abstract
+ * Returns an attribute for creating queues that share their target queue in
+ * proportion to the given weight.
+ *
+ * @discussion
+ * Queues with a weight are scheduled by deficit round-robin among the queues
+ * submitted to the same target queue: each time such a queue is invoked, it
+ * is credited its weight times a fixed quantum of time (or times the time
+ * quantum set with dispatch_queue_set_drain_quantum()), and it goes to the
+ * back of its target queue once the credit is spent. Time used past the
+ * credit is deducted from the next turn. When queues are contending for a
+ * serial target queue, or for a limited number of threads, the time each of
+ * them gets converges to its share of the total weight.
+ *
+ * The returned attribute must be released with dispatch_release() once the
+ * queues have been created.
+ *
+ * @param attr
+ * DISPATCH_QUEUE_SERIAL or DISPATCH_QUEUE_CONCURRENT.
+ *
+ * @param weight
+ * The weight of the queues, zero for unweighted queues.
+ *
+ * @result
+ * The newly created queue attribute.
+ */
+DISPATCH_EXPORT DISPATCH_MALLOC DISPATCH_RETURNS_RETAINED DISPATCH_WARN_RESULT
+DISPATCH_NOTHROW
+dispatch_queue_attr_t
+dispatch_queue_attr_make_with_weight(dispatch_queue_attr_t attr,
+		unsigned int weight);
+
+/*!
+ * @typedef dispatch_queue_overflow_t
+ *
+ * @abstract
+ * What happens to a work item submitted to a queue holding as many pending
+ * work items as its capacity.
+ *
+ * @constant DISPATCH_QUEUE_OVERFLOW_BLOCK
+ * The submitting thread blocks until the queue has drained below half of its
+ * capacity. Work items submitted from the queue itself, or from a queue that
+ * targets it, are never blocked, nor are those submitted by dispatch_after()
+ * and dispatch sources.
+ *
+ * @constant DISPATCH_QUEUE_OVERFLOW_FAIL
+ * dispatch_async_try_f() fails, other submissions are accepted past the
+ * capacity.
+ *
+ * @constant DISPATCH_QUEUE_OVERFLOW_DROP_OLDEST
+ * The submission is accepted and the oldest pending work items past the
+ * capacity are discarded without being invoked when the queue drains.
+ * Blocks are released, but the contexts of functions are not.
+ */
+enum {
+	DISPATCH_QUEUE_OVERFLOW_BLOCK = 0,
+	DISPATCH_QUEUE_OVERFLOW_FAIL,
+	DISPATCH_QUEUE_OVERFLOW_DROP_OLDEST,
+};
+typedef unsigned long dispatch_queue_overflow_t;
+
+/*!
+ * @function dispatch_queue_attr_make_with_capacity
+ *
+ * @abstract
+ * Returns an attribute for creating serial queues that hold a bounded number
+ * of pending work items.
+ *
+ * @discussion
+ * Work items submitted with the dispatch_async, dispatch_barrier_async and
+ * dispatch_group_async families of functions are pending from their
+ * submission until the queue starts invoking them. Capacities of concurrent
+ * queues are ignored.
+ *
+ * The returned attribute must be released with dispatch_release() once the
+ * queues have been created.
+ *
+ * @param attr
+ * DISPATCH_QUEUE_SERIAL or an attribute returned by another
+ * dispatch_queue_attr_make function.
+ *
+ * @param capacity
+ * The maximum number of pending work items, zero for an unbounded queue.
+ *
+ * @param overflow
+ * The policy applied when the queue is full.
+ *
+ * @result
+ * The newly created queue attribute.
+ */
+DISPATCH_EXPORT DISPATCH_MALLOC DISPATCH_RETURNS_RETAINED DISPATCH_WARN_RESULT
+DISPATCH_NOTHROW
+dispatch_queue_attr_t
+dispatch_queue_attr_make_with_capacity(dispatch_queue_attr_t attr,
+		size_t capacity, dispatch_queue_overflow_t overflow);
+
+/*!
+ * @function dispatch_async_try_f
+ *
+ * @abstract
+ * Submits a function for asynchronous execution on a dispatch queue unless
+ * the queue is full.
+ *
+ * @discussion
+ * Never blocks. On queues without a capacity this is equivalent to
+ * dispatch_async_f(). On a full queue created with the
+ * DISPATCH_QUEUE_OVERFLOW_DROP_OLDEST policy the function is submitted and
+ * the oldest pending work item will be discarded.
+ *
+ * @param queue
+ * The target dispatch queue to which the function is submitted.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @param context
+ * The application-defined context parameter to pass to the function.
+ *
+ * @param work
+ * The application-defined function to invoke on the target queue.
+ * The result of passing NULL in this parameter is undefined.
+ *
+ * @result
+ * Returns zero on success, or ENOBUFS if the queue is full and the function
+ * was not submitted.
+ */
+DISPATCH_EXPORT DISPATCH_NONNULL1 DISPATCH_NONNULL3 DISPATCH_NOTHROW
+long
+dispatch_async_try_f(dispatch_queue_t queue, void *context,
+		dispatch_function_t work);
+
+/*!
+ * @function dispatch_queue_enable_stats
+ *
+ * @abstract
+ * Starts collecting statistics for the given queue.
+ *
+ * @discussion
+ * Statistics cover the work items submitted with the dispatch_async,
+ * dispatch_barrier_async and dispatch_group_async families of functions
+ * after this call, and cannot be disabled again. Counters are kept per CPU
+ * and are cheap enough to leave enabled. Setting the LIBDISPATCH_QUEUE_STATS
+ * environment variable enables statistics on every queue created by
+ * dispatch_queue_create().
+ *
+ * @param queue
+ * The queue to collect statistics for. Passing the main queue or a global
+ * concurrent queue will be ignored.
+ */
+DISPATCH_EXPORT DISPATCH_NONNULL_ALL DISPATCH_NOTHROW
+void
+dispatch_queue_enable_stats(dispatch_queue_t queue);
+
+/*!
+ * @struct dispatch_queue_stats_s
+ *
+ * @abstract
+ * Statistics of a queue, see dispatch_queue_get_stats().
+ *
+ * @discussion
+ * Histogram bucket i counts the events that took less than 2^i nanoseconds
+ * and at least 2^(i-1), the last bucket also counts all longer events.
+ * Work items submitted with dispatch_async_inline_f() are not counted in the
+ * latency histogram.
+ *
+ * @field enqueued
+ * The number of work items submitted to the queue.
+ *
+ * @field dequeued
+ * The number of work items the queue started invoking or discarded.
+ *
+ * @field depth
+ * The number of pending work items.
+ *
+ * @field latency
+ * Histogram of the time from the submission of work items to the start of
+ * their invocation.
+ *
+ * @field execution
+ * Histogram of the time taken by the invocation of work items.
+ */
+#define DISPATCH_QUEUE_STATS_BUCKETS 40
+
+struct dispatch_queue_stats_s {
+	uint64_t enqueued;
+	uint64_t dequeued;
+	uint64_t depth;
+	uint64_t latency[DISPATCH_QUEUE_STATS_BUCKETS];
+	uint64_t execution[DISPATCH_QUEUE_STATS_BUCKETS];
+};
+
+/*!
+ * @function dispatch_queue_get_stats
+ *
+ * @abstract
+ * Returns a snapshot of the statistics of the given queue.
+ *
+ * @discussion
+ * The counters are read without stopping the queue, the snapshot may be off
+ * by the work items submitted or invoked while it is taken.
+ *
+ * @param queue
+ * The queue to query.
+ *
+ * @param stats
+ * The structure to fill in.
+ *
+ * @result
+ * Returns zero on success, or ENOTSUP if statistics are not enabled for the
+ * queue, in which case stats is zeroed.
+ */
+DISPATCH_EXPORT DISPATCH_NONNULL_ALL DISPATCH_NOTHROW
+long
+dispatch_queue_get_stats(dispatch_queue_t queue,
+		struct dispatch_queue_stats_s *stats);
+
 /*!
  * @function dispatch_set_current_target_queue
  *
@@ -129,7 +375,8 @@ DISPATCH_EXPORT const struct dispatch_queue_offsets_s {
  * @function dispatch_flush_continuation_cache
  *
  * @abstract
- * Flushes the current thread's cache of continuation objects, if any.
+ * Flushes the current thread's cache of continuation objects, if any, as
+ * well as the continuations cached for reuse by other threads.
  *
  * @discussion
  * Warning: this function is subject to change in a future release.
@@ -92,7 +92,9 @@ _dispatch_apply_serial(void *ctxt)
 }
 
 // 64 threads should be good enough for the short to mid term
+#ifndef DISPATCH_APPLY_MAX_CPUS
 #define DISPATCH_APPLY_MAX_CPUS 64
+#endif
 
 DISPATCH_ALWAYS_INLINE
 static inline void
@@ -182,7 +184,7 @@ dispatch_apply_f(size_t iterations, dispatch_queue_t dq, void *ctxt,
 	da->da_ctxt = ctxt;
 	da->da_iterations = iterations;
 	da->da_index = 0;
-	da->da_thr_cnt = _dispatch_hw_config.cc_max_active;
+	da->da_thr_cnt = _dispatch_hw_config_active();
 	da->da_done = 0;
 	da->da_queue = NULL;
 
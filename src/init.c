@@ -95,6 +95,8 @@ pthread_key_t dispatch_apply_key;
 #if DISPATCH_PERF_MON
 pthread_key_t dispatch_bcounter_key;
 #endif
+pthread_key_t dispatch_deque_key;
+pthread_key_t dispatch_specific_key;
 #endif // !DISPATCH_USE_DIRECT_TSD
 
 struct _dispatch_hw_config_s _dispatch_hw_config;
@@ -153,6 +155,7 @@ struct dispatch_queue_attr_s _dispatch_queue_attr_concurrent = {
 	.do_ref_cnt = DISPATCH_OBJECT_GLOBAL_REFCNT,
 	.do_xref_cnt = DISPATCH_OBJECT_GLOBAL_REFCNT,
 	.do_next = (dispatch_queue_attr_t)DISPATCH_OBJECT_LISTLESS,
+	.dqa_concurrent = true,
 };
 
 #pragma mark -
@@ -219,7 +222,7 @@ DISPATCH_VTABLE_INSTANCE(queue_attr,
 	.do_debug = NULL,
 	.do_invoke = NULL,
 	.do_probe = NULL,
-	.do_dispose = NULL,
+	.do_dispose = DISPOSE_FUNCTION(queue_attr, _dispatch_queue_attr_dispose),
 );
 
 DISPATCH_VTABLE_INSTANCE(source,
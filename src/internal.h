@@ -154,6 +154,7 @@
 #include <malloc/malloc.h>
 #endif
 #include <sys/event.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/sysctl.h>
@@ -377,6 +378,8 @@ void _dispatch_source_drain_kevent(struct kevent *);
 
 long _dispatch_update_kq(const struct kevent *);
 void _dispatch_run_timers(void);
+void _dispatch_timer_after(dispatch_time_t when, dispatch_queue_t dq,
+		void *ctxt, dispatch_function_t func);
 // Returns howsoon with updated time value, or NULL if no timers active.
 struct timespec *_dispatch_get_next_timer_fire(struct timespec *howsoon);
 
@@ -393,6 +396,8 @@ extern struct _dispatch_hw_config_s {
 	uint32_t cc_max_physical;
 } _dispatch_hw_config;
 
+uint32_t _dispatch_hw_config_active(void);
+
 /* #includes dependent on internal.h */
 #include "shims.h"
 
@@ -564,6 +564,7 @@ _dispatch_io_set_target_queue(dispatch_io_t channel, dispatch_queue_t dq)
 		dispatch_queue_t prev_dq = channel->do_targetq;
 		channel->do_targetq = dq;
 		_dispatch_release(prev_dq);
+		_dispatch_queue_specific_invalidate();
 		_dispatch_release(channel);
 	});
 }
@@ -888,6 +889,7 @@ _dispatch_operation_create(dispatch_op_direction_t direction,
 	op->op_q = dispatch_queue_create("com.apple.libdispatch-io.opq", NULL);
 	op->op_q->do_targetq = queue;
 	_dispatch_retain(queue);
+	_dispatch_queue_specific_invalidate();
 	op->active = false;
 	op->direction = direction;
 	op->offset = offset + channel->f_ptr;
@@ -1091,6 +1093,7 @@ _dispatch_fd_entry_create(dispatch_queue_t q)
 	// the close queue is running
 	fd_entry->close_queue->do_targetq = q;
 	_dispatch_retain(q);
+	_dispatch_queue_specific_invalidate();
 	// Suspend the cleanup queue until closing
 	_dispatch_fd_entry_retain(fd_entry);
 	return fd_entry;
@@ -1363,6 +1366,7 @@ _dispatch_stream_init(dispatch_fd_entry_t fd_entry, dispatch_queue_t tq)
 				NULL);
 		_dispatch_retain(tq);
 		stream->dq->do_targetq = tq;
+		_dispatch_queue_specific_invalidate();
 		TAILQ_INIT(&stream->operations[DISPATCH_IO_RANDOM]);
 		TAILQ_INIT(&stream->operations[DISPATCH_IO_STREAM]);
 		fd_entry->streams[direction] = stream;
@@ -24,12 +24,18 @@
 #undef dispatch_once_f
 
 
+#if DISPATCH_USE_FUTEX && DISPATCH_ATOMIC_ACQUIRE_RELEASE
+#define DISPATCH_ONCE_USE_FUTEX 1
+#endif
+
+#if !DISPATCH_ONCE_USE_FUTEX
 struct _dispatch_once_waiter_s {
 	volatile struct _dispatch_once_waiter_s *volatile dow_next;
 	_dispatch_thread_semaphore_t dow_sema;
 };
 
 #define DISPATCH_ONCE_DONE ((struct _dispatch_once_waiter_s *)~0l)
+#endif
 
 #ifdef __BLOCKS__
 void
@@ -41,6 +47,56 @@ dispatch_once(dispatch_once_t *val, dispatch_block_t block)
 }
 #endif
 
+#if DISPATCH_ONCE_USE_FUTEX
+// The predicate goes from 0 to DISPATCH_ONCE_RUNNING while the function runs,
+// to DISPATCH_ONCE_WAITERS once another thread waits for it, and to ~0l when
+// the function has returned. The store of ~0l releases the stores of the
+// function to the acquire load of the inline check in <dispatch/once.h>, and
+// waiters sleep on the futex word holding the low bits of the predicate.
+#define DISPATCH_ONCE_RUNNING 1l
+#define DISPATCH_ONCE_WAITERS 2l
+#define DISPATCH_ONCE_DONE (~0l)
+
+DISPATCH_ALWAYS_INLINE
+static inline volatile int32_t *
+_dispatch_once_futex(dispatch_once_t *val)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (volatile int32_t *)val + (sizeof(*val) / sizeof(int32_t) - 1);
+#else
+	return (volatile int32_t *)val;
+#endif
+}
+
+DISPATCH_NOINLINE
+void
+dispatch_once_f(dispatch_once_t *val, void *ctxt, dispatch_function_t func)
+{
+	volatile long *vval = val;
+	long v;
+
+	if (dispatch_atomic_cmpxchg(vval, 0l, DISPATCH_ONCE_RUNNING)) {
+		_dispatch_client_callout(ctxt, func);
+		v = dispatch_atomic_xchg_release(vval, DISPATCH_ONCE_DONE);
+		if (slowpath(v == DISPATCH_ONCE_WAITERS)) {
+			(void)_dispatch_futex_wake(_dispatch_once_futex(val), INT32_MAX);
+		}
+		return;
+	}
+	for (;;) {
+		v = dispatch_atomic_load_acquire(vval);
+		if (fastpath(v == DISPATCH_ONCE_DONE)) {
+			return;
+		}
+		if (v == DISPATCH_ONCE_RUNNING && !dispatch_atomic_cmpxchg(vval,
+				DISPATCH_ONCE_RUNNING, DISPATCH_ONCE_WAITERS)) {
+			continue;
+		}
+		(void)_dispatch_futex_wait(_dispatch_once_futex(val),
+				(int32_t)DISPATCH_ONCE_WAITERS, NULL);
+	}
+}
+#else
 DISPATCH_NOINLINE
 void
 dispatch_once_f(dispatch_once_t *val, void *ctxt, dispatch_function_t func)
@@ -133,3 +189,4 @@ dispatch_once_f(dispatch_once_t *val, void *ctxt, dispatch_function_t func)
 		_dispatch_put_thread_semaphore(dow.dow_sema);
 	}
 }
+#endif // DISPATCH_ONCE_USE_FUTEX
@@ -28,6 +28,14 @@
 #define DISPATCH_LINUX_COMPAT 1
 #endif
 
+#if DISPATCH_LINUX_COMPAT && !defined(DISPATCH_USE_EPOLL)
+#define DISPATCH_USE_EPOLL 1
+#endif
+#if DISPATCH_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#endif
+
 #if (!HAVE_PTHREAD_WORKQUEUES || DISPATCH_DEBUG) && \
 		!defined(DISPATCH_ENABLE_THREAD_POOL)
 #define DISPATCH_ENABLE_THREAD_POOL 1
@@ -35,6 +43,29 @@
 #if DISPATCH_ENABLE_THREAD_POOL && !DISPATCH_USE_LEGACY_WORKQUEUE_FALLBACK
 #define pthread_workqueue_t void*
 #endif
+// Per-worker deques for items async'd from inside the pool, off by default
+// until they are shown to pay off on many-core machines
+#ifndef DISPATCH_USE_WORK_STEALING
+#define DISPATCH_USE_WORK_STEALING 0
+#endif
+#if DISPATCH_USE_WORK_STEALING
+#ifndef DISPATCH_WORKER_DEQUE_SIZE
+#define DISPATCH_WORKER_DEQUE_SIZE 256 // must be a power of 2
+#endif
+#ifndef DISPATCH_WORKER_DEQUE_COUNT
+#define DISPATCH_WORKER_DEQUE_COUNT 64
+#endif
+// Check the shared root queue list before the local deque once per interval
+// so that items submitted from outside the pool are not starved
+#ifndef DISPATCH_WORKER_DEQUE_INJECT_INTERVAL
+#define DISPATCH_WORKER_DEQUE_INJECT_INTERVAL 61
+#endif
+#endif
+
+DISPATCH_EXPORT DISPATCH_NOTHROW
+void _dispatch_mgrcntl(uint32_t param, uint64_t value);
+DISPATCH_EXPORT DISPATCH_NOTHROW
+void _dispatch_poolcntl(dispatch_queue_t dq, uint32_t param, uint64_t value);
 
 static void _dispatch_cache_cleanup(void *value);
 static void _dispatch_async_f_redirect(dispatch_queue_t dq,
@@ -43,9 +74,25 @@ static void _dispatch_queue_cleanup(void *ctxt);
 static inline void _dispatch_queue_wakeup_global2(dispatch_queue_t dq,
 		unsigned int n);
 static inline void _dispatch_queue_wakeup_global(dispatch_queue_t dq);
-static _dispatch_thread_semaphore_t _dispatch_queue_drain(dispatch_queue_t dq);
+static inline void _dispatch_queue_wakeup_global3(dispatch_queue_t dq,
+		unsigned int n);
+#if DISPATCH_USE_WORK_STEALING
+static inline bool _dispatch_worker_deque_push(dispatch_queue_t dq,
+		dispatch_object_t dou);
+#endif
+static _dispatch_thread_semaphore_t _dispatch_queue_drain(dispatch_queue_t dq,
+		bool *yielded);
 static inline _dispatch_thread_semaphore_t
 		_dispatch_queue_drain_one_barrier_sync(dispatch_queue_t dq);
+static dispatch_queue_capacity_t _dispatch_queue_capacity_create(
+		dispatch_queue_attr_t dqa);
+static void _dispatch_queue_capacity_dispose(dispatch_queue_capacity_t dqc);
+static void _dispatch_barrier_async_detached_f(dispatch_queue_t dq,
+		void *ctxt, dispatch_function_t func);
+static bool _dispatch_queue_stats_default;
+static void _dispatch_queue_stats_init(void);
+static void _dispatch_queue_stats_dispose(dispatch_queue_stats_shards_t dqst);
+static void _dispatch_async_f_redirect_invoke(void *_ctxt);
 #if DISPATCH_USE_LEGACY_WORKQUEUE_FALLBACK
 static void _dispatch_worker_thread3(void *context);
 #endif
@@ -54,6 +101,8 @@ static void _dispatch_worker_thread2(int priority, int options, void *context);
 #endif
 #if DISPATCH_ENABLE_THREAD_POOL
 static void *_dispatch_worker_thread(void *context);
+static void _dispatch_thread_pool_set_max(dispatch_queue_t dq, uint32_t max);
+static void _dispatch_thread_pool_config_init(void);
 static int _dispatch_pthread_sigmask(int how, sigset_t *set, sigset_t *oset);
 #endif
 
@@ -80,6 +129,37 @@ static int main_q_eventfd = -1;
 #pragma mark dispatch_root_queue
 
 #if DISPATCH_ENABLE_THREAD_POOL
+#if DISPATCH_USE_FUTEX
+// Idle pool threads park on a LIFO stack so that a wakeup goes to the most
+// recently idled (cache-warm) thread and the coldest ones time out and exit.
+// Each thread blocks on a futex word in its own stack frame. Wakeups that find
+// no idle thread are counted in dtm_pending, like signals of the semaphore
+// mediator, and consumed by the next thread about to go idle.
+struct dispatch_thread_idle_s {
+	struct dispatch_thread_idle_s *dti_next;
+	int32_t volatile dti_futex; // 0 while parked, 1 once woken
+};
+
+struct dispatch_thread_mediator_s {
+	int32_t volatile dtm_lock;
+	unsigned int dtm_pending;
+	struct dispatch_thread_idle_s *dtm_head;
+};
+typedef struct dispatch_thread_mediator_s *dispatch_thread_mediator_t;
+
+static struct dispatch_thread_mediator_s _dispatch_thread_mediator[] = {
+	[DISPATCH_ROOT_QUEUE_IDX_LOW_PRIORITY] = { },
+	[DISPATCH_ROOT_QUEUE_IDX_LOW_OVERCOMMIT_PRIORITY] = { },
+	[DISPATCH_ROOT_QUEUE_IDX_DEFAULT_PRIORITY] = { },
+	[DISPATCH_ROOT_QUEUE_IDX_DEFAULT_OVERCOMMIT_PRIORITY] = { },
+	[DISPATCH_ROOT_QUEUE_IDX_HIGH_PRIORITY] = { },
+	[DISPATCH_ROOT_QUEUE_IDX_HIGH_OVERCOMMIT_PRIORITY] = { },
+	[DISPATCH_ROOT_QUEUE_IDX_BACKGROUND_PRIORITY] = { },
+	[DISPATCH_ROOT_QUEUE_IDX_BACKGROUND_OVERCOMMIT_PRIORITY] = { },
+};
+#else
+typedef dispatch_semaphore_t dispatch_thread_mediator_t;
+
 static struct dispatch_semaphore_s _dispatch_thread_mediator[] = {
 	[DISPATCH_ROOT_QUEUE_IDX_LOW_PRIORITY] = {
 		.do_vtable = DISPATCH_VTABLE(semaphore),
@@ -122,14 +202,18 @@ static struct dispatch_semaphore_s _dispatch_thread_mediator[] = {
 		.do_xref_cnt = DISPATCH_OBJECT_GLOBAL_REFCNT,
 	},
 };
-#endif
+#endif // DISPATCH_USE_FUTEX
+#endif // DISPATCH_ENABLE_THREAD_POOL
 
+#ifndef MAX_THREAD_COUNT
 #define MAX_THREAD_COUNT 255
+#endif
 
 struct dispatch_root_queue_context_s {
 	union {
 		struct {
 			unsigned int volatile dgq_pending;
+			unsigned int volatile dgq_spin_limit; // learned head spin ceiling
 #if HAVE_PTHREAD_WORKQUEUES
 			int dgq_wq_priority, dgq_wq_options;
 #if DISPATCH_USE_LEGACY_WORKQUEUE_FALLBACK || DISPATCH_ENABLE_THREAD_POOL
@@ -137,8 +221,14 @@ struct dispatch_root_queue_context_s {
 #endif
 #endif // HAVE_PTHREAD_WORKQUEUES
 #if DISPATCH_ENABLE_THREAD_POOL
-			dispatch_semaphore_t dgq_thread_mediator;
-			uint32_t dgq_thread_pool_size;
+			dispatch_thread_mediator_t dgq_thread_mediator;
+			uint32_t volatile dgq_thread_pool_size; // free thread slots
+			uint32_t volatile dgq_thread_pool_max;
+			uint32_t dgq_thread_pool_min;
+#endif
+#if DISPATCH_USE_WORK_STEALING
+			struct dispatch_worker_deque_s *volatile dgq_deques;
+			unsigned int volatile dgq_deque_width;
 #endif
 		};
 		char _dgq_pad[DISPATCH_CACHELINE_SIZE];
@@ -157,6 +247,7 @@ static struct dispatch_root_queue_context_s _dispatch_root_queue_contexts[] = {
 		.dgq_thread_mediator = &_dispatch_thread_mediator[
 				DISPATCH_ROOT_QUEUE_IDX_LOW_PRIORITY],
 		.dgq_thread_pool_size = MAX_THREAD_COUNT,
+		.dgq_thread_pool_max = MAX_THREAD_COUNT,
 #endif
 	}}},
 	[DISPATCH_ROOT_QUEUE_IDX_LOW_OVERCOMMIT_PRIORITY] = {{{
@@ -169,6 +260,7 @@ static struct dispatch_root_queue_context_s _dispatch_root_queue_contexts[] = {
 		.dgq_thread_mediator = &_dispatch_thread_mediator[
 				DISPATCH_ROOT_QUEUE_IDX_LOW_OVERCOMMIT_PRIORITY],
 		.dgq_thread_pool_size = MAX_THREAD_COUNT,
+		.dgq_thread_pool_max = MAX_THREAD_COUNT,
 #endif
 	}}},
 	[DISPATCH_ROOT_QUEUE_IDX_DEFAULT_PRIORITY] = {{{
@@ -181,6 +273,7 @@ static struct dispatch_root_queue_context_s _dispatch_root_queue_contexts[] = {
 		.dgq_thread_mediator = &_dispatch_thread_mediator[
 				DISPATCH_ROOT_QUEUE_IDX_DEFAULT_PRIORITY],
 		.dgq_thread_pool_size = MAX_THREAD_COUNT,
+		.dgq_thread_pool_max = MAX_THREAD_COUNT,
 #endif
 	}}},
 	[DISPATCH_ROOT_QUEUE_IDX_DEFAULT_OVERCOMMIT_PRIORITY] = {{{
@@ -193,6 +286,7 @@ static struct dispatch_root_queue_context_s _dispatch_root_queue_contexts[] = {
 		.dgq_thread_mediator = &_dispatch_thread_mediator[
 				DISPATCH_ROOT_QUEUE_IDX_DEFAULT_OVERCOMMIT_PRIORITY],
 		.dgq_thread_pool_size = MAX_THREAD_COUNT,
+		.dgq_thread_pool_max = MAX_THREAD_COUNT,
 #endif
 	}}},
 	[DISPATCH_ROOT_QUEUE_IDX_HIGH_PRIORITY] = {{{
@@ -205,6 +299,7 @@ static struct dispatch_root_queue_context_s _dispatch_root_queue_contexts[] = {
 		.dgq_thread_mediator = &_dispatch_thread_mediator[
 				DISPATCH_ROOT_QUEUE_IDX_HIGH_PRIORITY],
 		.dgq_thread_pool_size = MAX_THREAD_COUNT,
+		.dgq_thread_pool_max = MAX_THREAD_COUNT,
 #endif
 	}}},
 	[DISPATCH_ROOT_QUEUE_IDX_HIGH_OVERCOMMIT_PRIORITY] = {{{
@@ -217,6 +312,7 @@ static struct dispatch_root_queue_context_s _dispatch_root_queue_contexts[] = {
 		.dgq_thread_mediator = &_dispatch_thread_mediator[
 				DISPATCH_ROOT_QUEUE_IDX_HIGH_OVERCOMMIT_PRIORITY],
 		.dgq_thread_pool_size = MAX_THREAD_COUNT,
+		.dgq_thread_pool_max = MAX_THREAD_COUNT,
 #endif
 	}}},
 	[DISPATCH_ROOT_QUEUE_IDX_BACKGROUND_PRIORITY] = {{{
@@ -229,6 +325,7 @@ static struct dispatch_root_queue_context_s _dispatch_root_queue_contexts[] = {
 		.dgq_thread_mediator = &_dispatch_thread_mediator[
 				DISPATCH_ROOT_QUEUE_IDX_BACKGROUND_PRIORITY],
 		.dgq_thread_pool_size = MAX_THREAD_COUNT,
+		.dgq_thread_pool_max = MAX_THREAD_COUNT,
 #endif
 	}}},
 	[DISPATCH_ROOT_QUEUE_IDX_BACKGROUND_OVERCOMMIT_PRIORITY] = {{{
@@ -241,6 +338,7 @@ static struct dispatch_root_queue_context_s _dispatch_root_queue_contexts[] = {
 		.dgq_thread_mediator = &_dispatch_thread_mediator[
 				DISPATCH_ROOT_QUEUE_IDX_BACKGROUND_OVERCOMMIT_PRIORITY],
 		.dgq_thread_pool_size = MAX_THREAD_COUNT,
+		.dgq_thread_pool_max = MAX_THREAD_COUNT,
 #endif
 	}}},
 };
@@ -479,12 +577,62 @@ dispatch_get_current_queue(void)
 #pragma mark -
 #pragma mark dispatch_init
 
+// the active CPU count is re-evaluated at most this often (in nanoseconds) to
+// pick up changes to the affinity mask or the cgroup CPU quota
+#ifndef DISPATCH_HW_CONFIG_REFRESH_INTERVAL
+#define DISPATCH_HW_CONFIG_REFRESH_INTERVAL NSEC_PER_SEC
+#endif
+
+static uint64_t volatile _dispatch_hw_config_refresh;
+
 static void
 _dispatch_hw_config_init(void)
 {
 	_dispatch_hw_config.cc_max_active = _dispatch_get_activecpu();
 	_dispatch_hw_config.cc_max_logical = _dispatch_get_logicalcpu_max();
 	_dispatch_hw_config.cc_max_physical = _dispatch_get_physicalcpu_max();
+	_dispatch_hw_config_refresh = _dispatch_absolute_time() +
+			_dispatch_time_nano2mach(DISPATCH_HW_CONFIG_REFRESH_INTERVAL);
+}
+
+static void
+_dispatch_hw_config_update(void *ctxt DISPATCH_UNUSED)
+{
+	uint32_t active = _dispatch_get_activecpu();
+#if DISPATCH_ENABLE_THREAD_POOL && TARGET_OS_EMBEDDED
+	uint32_t old_active = dispatch_atomic_xchg(
+			&_dispatch_hw_config.cc_max_active, active);
+	int i;
+	for (i = 0; i < DISPATCH_ROOT_QUEUE_COUNT; i += 2) {
+		struct dispatch_root_queue_context_s *qc =
+				_dispatch_root_queues[i].do_ctxt;
+		// resize the pools sized by _dispatch_root_queues_init_thread_pool()
+		if (active != old_active && qc->dgq_thread_pool_max == old_active) {
+			_dispatch_thread_pool_set_max(&_dispatch_root_queues[i], active);
+		}
+	}
+#else
+	(void)dispatch_atomic_xchg(&_dispatch_hw_config.cc_max_active, active);
+#endif
+}
+
+// Returns the cached active CPU count. Once it is due for a refresh the
+// /proc and cgroup reads are done on a low priority root queue, callers such
+// as dispatch_apply_f() never wait for them.
+uint32_t
+_dispatch_hw_config_active(void)
+{
+	uint64_t now = _dispatch_absolute_time();
+	uint64_t refresh = _dispatch_hw_config_refresh;
+
+	if (slowpath(now >= refresh) && dispatch_atomic_cmpxchg(
+			&_dispatch_hw_config_refresh, refresh, now +
+			_dispatch_time_nano2mach(DISPATCH_HW_CONFIG_REFRESH_INTERVAL))) {
+		dispatch_async_f(_dispatch_get_root_queue(
+				DISPATCH_QUEUE_PRIORITY_LOW, false), NULL,
+				_dispatch_hw_config_update);
+	}
+	return _dispatch_hw_config.cc_max_active;
 }
 
 static inline bool
@@ -562,11 +710,13 @@ _dispatch_root_queues_init_thread_pool(void)
 		// overcommit when threads block. Someday, this behavior should apply
 		// to all platforms
 		if (!(i & 1)) {
-			_dispatch_root_queue_contexts[i].dgq_thread_pool_size =
-					_dispatch_hw_config.cc_max_active;
+			_dispatch_thread_pool_set_max(&_dispatch_root_queues[i],
+					_dispatch_hw_config.cc_max_active);
 		}
 #endif
-#if USE_MACH_SEM
+#if DISPATCH_USE_FUTEX
+		// the idle stacks are statically initialized
+#elif USE_MACH_SEM
 		// override the default FIFO behavior for the pool semaphores
 		kern_return_t kr = semaphore_create(mach_task_self(),
 				&_dispatch_thread_mediator[i].dsema_port, SYNC_POLICY_LIFO, 0);
@@ -584,6 +734,8 @@ _dispatch_root_queues_init_thread_pool(void)
 #endif // DISPATCH_ENABLE_THREAD_POOL
 }
 
+static dispatch_once_t _dispatch_root_queues_pred;
+
 static void
 _dispatch_root_queues_init(void *context DISPATCH_UNUSED)
 {
@@ -620,14 +772,26 @@ libdispatch_init(void)
 #endif
 
 	dispatch_assert(sizeof(struct dispatch_apply_s) <=
-			ROUND_UP_TO_CACHELINE_SIZE(sizeof(
-			struct dispatch_continuation_s)));
+			DISPATCH_CONTINUATION_SLOT_SIZE);
+	dispatch_assert(sizeof(struct dispatch_continuation_s) <=
+			DISPATCH_CONTINUATION_SLOT_SIZE);
+	dispatch_assert(DISPATCH_CONTINUATION_SLOT_SIZE %
+			DISPATCH_CACHELINE_SIZE == 0);
 	dispatch_assert(sizeof(struct dispatch_source_s) ==
 			sizeof(struct dispatch_queue_s) - DISPATCH_QUEUE_CACHELINE_PAD);
 	dispatch_assert(sizeof(struct dispatch_queue_s) % DISPATCH_CACHELINE_SIZE
 			== 0);
+#if DISPATCH_QUEUE_SEPARATE_TAIL
+	dispatch_assert(offsetof(struct dispatch_queue_s, dq_items_tail) -
+			offsetof(struct dispatch_queue_s, dq_items_head) >=
+			DISPATCH_CACHELINE_SIZE);
+#endif
 	dispatch_assert(sizeof(struct dispatch_root_queue_context_s) %
 			DISPATCH_CACHELINE_SIZE == 0);
+#if DISPATCH_USE_WORK_STEALING
+	dispatch_assert(!(DISPATCH_WORKER_DEQUE_SIZE &
+			(DISPATCH_WORKER_DEQUE_SIZE - 1)));
+#endif
 
 	_dispatch_thread_key_create(&dispatch_queue_key, _dispatch_queue_cleanup);
 	_dispatch_thread_key_create(&dispatch_sema4_key,
@@ -638,6 +802,10 @@ libdispatch_init(void)
 #if DISPATCH_PERF_MON
 	_dispatch_thread_key_create(&dispatch_bcounter_key, NULL);
 #endif
+#if DISPATCH_USE_WORK_STEALING
+	_dispatch_thread_key_create(&dispatch_deque_key, NULL);
+#endif
+	_dispatch_thread_key_create(&dispatch_specific_key, free);
 
 #if DISPATCH_USE_RESOLVERS // rdar://problem/8541707
 	_dispatch_main_q.do_targetq = &_dispatch_root_queues[
@@ -654,6 +822,8 @@ libdispatch_init(void)
 	_dispatch_hw_config_init();
 	_dispatch_vtable_init();
 	_os_object_init();
+	_dispatch_thread_pool_config_init();
+	_dispatch_queue_stats_init();
 }
 
 DISPATCH_EXPORT DISPATCH_NOTHROW
@@ -713,18 +883,92 @@ dispatch_queue_create(const char *label, dispatch_queue_attr_t attr)
 	_dispatch_queue_init(dq);
 	strcpy(dq->dq_label, label);
 
+	if (slowpath(_dispatch_queue_stats_default)) {
+		dispatch_queue_enable_stats(dq);
+	}
 	if (fastpath(!attr)) {
 		return dq;
 	}
-	if (fastpath(attr == DISPATCH_QUEUE_CONCURRENT)) {
+	if (slowpath(dx_type(attr) != DISPATCH_QUEUE_ATTR_TYPE)) {
+		dispatch_debug_assert(!attr, "Invalid attribute");
+		return dq;
+	}
+	if (attr->dqa_concurrent) {
 		dq->dq_width = UINT32_MAX;
 		dq->do_targetq = _dispatch_get_root_queue(0, false);
-	} else {
-		dispatch_debug_assert(!attr, "Invalid attribute");
+		// capacities of concurrent queues are ignored
+	} else if (attr->dqa_capacity) {
+		dq->dq_capacity = _dispatch_queue_capacity_create(attr);
 	}
+	dq->dq_weight = attr->dqa_weight;
 	return dq;
 }
 
+#pragma mark -
+#pragma mark dispatch_queue_attr_t
+
+static dispatch_queue_attr_t
+_dispatch_queue_attr_copy(dispatch_queue_attr_t attr)
+{
+	dispatch_queue_attr_t dqa;
+
+	dqa = (dispatch_queue_attr_t)_dispatch_alloc(DISPATCH_VTABLE(queue_attr),
+			sizeof(struct dispatch_queue_attr_s));
+	dqa->do_next = (dispatch_queue_attr_t)DISPATCH_OBJECT_LISTLESS;
+	dqa->do_targetq = dispatch_get_global_queue(
+			DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	if (attr) {
+		dqa->dqa_capacity = attr->dqa_capacity;
+		dqa->dqa_overflow = attr->dqa_overflow;
+		dqa->dqa_weight = attr->dqa_weight;
+		dqa->dqa_concurrent = attr->dqa_concurrent;
+	}
+	return dqa;
+}
+
+// Weighted queues are scheduled by deficit round-robin among the queues
+// sharing their target: each turn a queue is credited weight times the
+// quantum of time, drains until the credit is spent and then goes to the back
+// of its target queue. Overruns of up to one turn are carried over while
+// other queues wait on the target, the credit is forgotten when the queue
+// runs out of items.
+#ifndef DISPATCH_QUEUE_WEIGHT_QUANTUM
+#define DISPATCH_QUEUE_WEIGHT_QUANTUM (100ull * NSEC_PER_USEC)
+#endif
+#ifndef DISPATCH_QUEUE_WEIGHT_MAX
+#define DISPATCH_QUEUE_WEIGHT_MAX 1000u
+#endif
+
+dispatch_queue_attr_t
+dispatch_queue_attr_make_with_weight(dispatch_queue_attr_t attr,
+		unsigned int weight)
+{
+	dispatch_queue_attr_t dqa = _dispatch_queue_attr_copy(attr);
+
+	dqa->dqa_weight = weight > DISPATCH_QUEUE_WEIGHT_MAX ?
+			DISPATCH_QUEUE_WEIGHT_MAX : weight;
+	return dqa;
+}
+
+dispatch_queue_attr_t
+dispatch_queue_attr_make_with_capacity(dispatch_queue_attr_t attr,
+		size_t capacity, dispatch_queue_overflow_t overflow)
+{
+	dispatch_queue_attr_t dqa = _dispatch_queue_attr_copy(attr);
+
+	if (slowpath(overflow > DISPATCH_QUEUE_OVERFLOW_DROP_OLDEST)) {
+		DISPATCH_CLIENT_CRASH("Invalid queue overflow policy");
+	}
+	dqa->dqa_capacity = capacity;
+	dqa->dqa_overflow = overflow;
+	return dqa;
+}
+
+void
+_dispatch_queue_attr_dispose(dispatch_queue_attr_t dqa DISPATCH_UNUSED)
+{
+}
+
 // 6618342 Contact the team that owns the Instrument DTrace probe before
 //         renaming this symbol
 void
@@ -745,6 +989,12 @@ _dispatch_queue_dispose(dispatch_queue_t dq)
 	if (dqsq) {
 		_dispatch_release(dqsq);
 	}
+	if (dq->dq_capacity) {
+		_dispatch_queue_capacity_dispose(dq->dq_capacity);
+	}
+	if (dq->dq_stats) {
+		_dispatch_queue_stats_dispose(dq->dq_stats);
+	}
 }
 
 const char *
@@ -771,7 +1021,7 @@ _dispatch_queue_set_width2(void *ctxt)
 		tmp = _dispatch_hw_config.cc_max_physical;
 		break;
 	case DISPATCH_QUEUE_WIDTH_ACTIVE_CPUS:
-		tmp = _dispatch_hw_config.cc_max_active;
+		tmp = _dispatch_hw_config_active();
 		break;
 	default:
 		// fall through
@@ -790,10 +1040,28 @@ dispatch_queue_set_width(dispatch_queue_t dq, long width)
 	if (slowpath(dq->do_ref_cnt == DISPATCH_OBJECT_GLOBAL_REFCNT)) {
 		return;
 	}
-	dispatch_barrier_async_f(dq, (void*)(intptr_t)width,
+	_dispatch_barrier_async_detached_f(dq, (void*)(intptr_t)width,
 			_dispatch_queue_set_width2);
 }
 
+void
+dispatch_queue_set_drain_quantum(dispatch_queue_t dq, unsigned long items,
+		uint64_t nanoseconds)
+{
+	if (slowpath(dq->do_ref_cnt == DISPATCH_OBJECT_GLOBAL_REFCNT)) {
+		return;
+	}
+	if (items > UINT32_MAX) {
+		items = UINT32_MAX;
+	}
+	if (nanoseconds > INT64_MAX) {
+		nanoseconds = INT64_MAX;
+	}
+	// Read by the next drain of the queue
+	dq->dq_drain_items = (uint32_t)items;
+	dq->dq_drain_time = _dispatch_time_nano2mach((int64_t)nanoseconds);
+}
+
 // 6618342 Contact the team that owns the Instrument DTrace probe before
 //         renaming this symbol
 static void
@@ -805,6 +1073,7 @@ _dispatch_set_target_queue2(void *ctxt)
 	prev_dq = dq->do_targetq;
 	dq->do_targetq = (dispatch_queue_t)ctxt;
 	_dispatch_release(prev_dq);
+	_dispatch_queue_specific_invalidate();
 }
 
 void
@@ -827,7 +1096,7 @@ dispatch_set_target_queue(dispatch_object_t dou, dispatch_queue_t dq)
 	case _DISPATCH_QUEUE_TYPE:
 	case _DISPATCH_SOURCE_TYPE:
 		_dispatch_retain(dq);
-		return dispatch_barrier_async_f(dou._dq, dq,
+		return _dispatch_barrier_async_detached_f(dou._dq, dq,
 				_dispatch_set_target_queue2);
 #if WITH_DISPATCH_IO
 	case _DISPATCH_IO_TYPE:
@@ -866,8 +1135,29 @@ dispatch_set_current_target_queue(dispatch_queue_t dq)
 #pragma mark -
 #pragma mark dispatch_queue_specific
 
-typedef TAILQ_HEAD(dispatch_queue_specific_head_s,
-	dispatch_queue_specific_s) dispatch_queue_specific_head_t;
+// Queue-specific contexts are kept in arrays that readers scan without taking
+// a lock. Setters are serialized on the queue-specific queue: they update the
+// context of a known key in place and append new keys behind the published
+// count. Keys are never removed, a NULL context stands for an unset key. A
+// full array is replaced by a copy of twice its size, the replaced arrays are
+// only freed with the queue since readers may still be scanning them.
+#ifndef DISPATCH_QUEUE_SPECIFIC_INITIAL_SIZE
+#define DISPATCH_QUEUE_SPECIFIC_INITIAL_SIZE 4u
+#endif
+
+struct dispatch_queue_specific_s {
+	const void *dqs_key;
+	void *volatile dqs_ctxt;
+	dispatch_function_t dqs_destructor;
+};
+DISPATCH_DECL(dispatch_queue_specific);
+
+typedef struct dispatch_queue_specific_list_s {
+	struct dispatch_queue_specific_list_s *dqsl_retired;
+	unsigned int volatile dqsl_count;
+	unsigned int dqsl_size;
+	struct dispatch_queue_specific_s dqsl_contexts[];
+} *dispatch_queue_specific_list_t;
 
 struct dispatch_queue_specific_queue_s {
 	DISPATCH_STRUCT_HEADER(queue_specific_queue);
@@ -876,31 +1166,50 @@ struct dispatch_queue_specific_queue_s {
 		char _dqsq_pad[DISPATCH_QUEUE_MIN_LABEL_SIZE];
 		struct {
 			char dq_label[16];
-			dispatch_queue_specific_head_t dqsq_contexts;
+			dispatch_queue_specific_list_t volatile dqsq_list;
 		};
 	};
 };
 
-struct dispatch_queue_specific_s {
-	const void *dqs_key;
-	void *dqs_ctxt;
-	dispatch_function_t dqs_destructor;
-	TAILQ_ENTRY(dispatch_queue_specific_s) dqs_list;
-};
-DISPATCH_DECL(dispatch_queue_specific);
+// Last result of dispatch_get_specific() on a thread. It is valid as long as
+// no queue-specific context and no target queue has been changed since.
+typedef struct dispatch_queue_specific_cache_s {
+	dispatch_queue_t dqsc_queue;
+	unsigned long dqsc_serialnum;
+	unsigned long dqsc_gen;
+	const void *dqsc_key;
+	void *dqsc_ctxt;
+} *dispatch_queue_specific_cache_t;
+
+DISPATCH_CACHELINE_ALIGN
+static unsigned long volatile _dispatch_queue_specific_gen;
+
+void
+_dispatch_queue_specific_invalidate(void)
+{
+	(void)dispatch_atomic_inc(&_dispatch_queue_specific_gen);
+}
 
 void
 _dispatch_queue_specific_queue_dispose(dispatch_queue_specific_queue_t dqsq)
 {
-	dispatch_queue_specific_t dqs, tmp;
+	dispatch_queue_specific_list_t dqsl = dqsq->dqsq_list, next;
+	unsigned int i;
 
-	TAILQ_FOREACH_SAFE(dqs, &dqsq->dqsq_contexts, dqs_list, tmp) {
-		if (dqs->dqs_destructor) {
-			dispatch_async_f(_dispatch_get_root_queue(
-					DISPATCH_QUEUE_PRIORITY_DEFAULT, false), dqs->dqs_ctxt,
-					dqs->dqs_destructor);
+	if (dqsl) {
+		for (i = 0; i < dqsl->dqsl_count; i++) {
+			if (dqsl->dqsl_contexts[i].dqs_ctxt &&
+					dqsl->dqsl_contexts[i].dqs_destructor) {
+				dispatch_async_f(_dispatch_get_root_queue(
+						DISPATCH_QUEUE_PRIORITY_DEFAULT, false),
+						dqsl->dqsl_contexts[i].dqs_ctxt,
+						dqsl->dqsl_contexts[i].dqs_destructor);
+			}
 		}
-		free(dqs);
+	}
+	for (; dqsl; dqsl = next) {
+		next = dqsl->dqsl_retired;
+		free(dqsl);
 	}
 	_dispatch_queue_dispose((dispatch_queue_t)dqsq);
 }
@@ -919,7 +1228,6 @@ _dispatch_queue_init_specific(dispatch_queue_t dq)
 			true);
 	dqsq->dq_width = UINT32_MAX;
 	strlcpy(dqsq->dq_label, "queue-specific", sizeof(dqsq->dq_label));
-	TAILQ_INIT(&dqsq->dqsq_contexts);
 	dispatch_atomic_store_barrier();
 	if (slowpath(!dispatch_atomic_cmpxchg2o(dq, dq_specific_q, NULL,
 			(dispatch_queue_t)dqsq))) {
@@ -927,35 +1235,69 @@ _dispatch_queue_init_specific(dispatch_queue_t dq)
 	}
 }
 
+// Publishes a copy of the list with room for more keys
+DISPATCH_NOINLINE
+static dispatch_queue_specific_list_t
+_dispatch_queue_specific_grow(dispatch_queue_specific_queue_t dqsq)
+{
+	dispatch_queue_specific_list_t dqsl, old_dqsl = dqsq->dqsq_list;
+	unsigned int count = old_dqsl ? old_dqsl->dqsl_count : 0;
+	unsigned int size = old_dqsl ? old_dqsl->dqsl_size * 2 :
+			DISPATCH_QUEUE_SPECIFIC_INITIAL_SIZE;
+
+	while (!(dqsl = malloc(sizeof(struct dispatch_queue_specific_list_s) +
+			size * sizeof(struct dispatch_queue_specific_s)))) {
+		sleep(1);
+	}
+	if (count) {
+		memcpy(dqsl->dqsl_contexts, old_dqsl->dqsl_contexts,
+				count * sizeof(struct dispatch_queue_specific_s));
+	}
+	dqsl->dqsl_retired = old_dqsl;
+	dqsl->dqsl_count = count;
+	dqsl->dqsl_size = size;
+	dispatch_atomic_store_barrier();
+	dqsq->dqsq_list = dqsl;
+	return dqsl;
+}
+
+// Runs as a barrier on the queue-specific queue, which serializes setters
 static void
 _dispatch_queue_set_specific(void *ctxt)
 {
 	dispatch_queue_specific_t dqs, dqsn = (dispatch_queue_specific_t)ctxt;
 	dispatch_queue_specific_queue_t dqsq =
 			(dispatch_queue_specific_queue_t)_dispatch_queue_get_current();
+	dispatch_queue_specific_list_t dqsl = dqsq->dqsq_list;
+	unsigned int i, count = dqsl ? dqsl->dqsl_count : 0;
+	void *old_ctxt;
 
-	TAILQ_FOREACH(dqs, &dqsq->dqsq_contexts, dqs_list) {
-		if (dqs->dqs_key == dqsn->dqs_key) {
-			// Destroy previous context for existing key
-			if (dqs->dqs_destructor) {
-				dispatch_async_f(_dispatch_get_root_queue(
-						DISPATCH_QUEUE_PRIORITY_DEFAULT, false), dqs->dqs_ctxt,
-						dqs->dqs_destructor);
-			}
-			if (dqsn->dqs_ctxt) {
-				// Copy new context for existing key
-				dqs->dqs_ctxt = dqsn->dqs_ctxt;
-				dqs->dqs_destructor = dqsn->dqs_destructor;
-			} else {
-				// Remove context storage for existing key
-				TAILQ_REMOVE(&dqsq->dqsq_contexts, dqs, dqs_list);
-				free(dqs);
-			}
-			return free(dqsn);
+	for (i = 0; i < count; i++) {
+		dqs = &dqsl->dqsl_contexts[i];
+		if (dqs->dqs_key != dqsn->dqs_key) {
+			continue;
+		}
+		old_ctxt = dqs->dqs_ctxt;
+		// Destroy previous context for existing key
+		if (old_ctxt && dqs->dqs_destructor) {
+			dispatch_async_f(_dispatch_get_root_queue(
+					DISPATCH_QUEUE_PRIORITY_DEFAULT, false), old_ctxt,
+					dqs->dqs_destructor);
 		}
+		dqs->dqs_destructor = dqsn->dqs_destructor;
+		dqs->dqs_ctxt = dqsn->dqs_ctxt;
+		return _dispatch_queue_specific_invalidate();
+	}
+	if (!dqsn->dqs_ctxt) {
+		return;
+	}
+	if (!dqsl || count == dqsl->dqsl_size) {
+		dqsl = _dispatch_queue_specific_grow(dqsq);
 	}
-	// Insert context storage for new key
-	TAILQ_INSERT_TAIL(&dqsq->dqsq_contexts, dqsn, dqs_list);
+	dqsl->dqsl_contexts[count] = *dqsn;
+	dispatch_atomic_store_barrier();
+	dqsl->dqsl_count = count + 1;
+	_dispatch_queue_specific_invalidate();
 }
 
 DISPATCH_NOINLINE
@@ -966,36 +1308,39 @@ dispatch_queue_set_specific(dispatch_queue_t dq, const void *key,
 	if (slowpath(!key)) {
 		return;
 	}
-	dispatch_queue_specific_t dqs;
+	struct dispatch_queue_specific_s dqs = {
+		.dqs_key = key,
+		.dqs_ctxt = ctxt,
+		.dqs_destructor = destructor,
+	};
 
-	dqs = (dispatch_queue_specific_t)
-			calloc(1, sizeof(struct dispatch_queue_specific_s));
-	dqs->dqs_key = key;
-	dqs->dqs_ctxt = ctxt;
-	dqs->dqs_destructor = destructor;
 	if (slowpath(!dq->dq_specific_q)) {
 		_dispatch_queue_init_specific(dq);
 	}
-	dispatch_barrier_async_f(dq->dq_specific_q, dqs,
+	dispatch_barrier_sync_f(dq->dq_specific_q, &dqs,
 			_dispatch_queue_set_specific);
 }
 
-static void
-_dispatch_queue_get_specific(void *ctxt)
+DISPATCH_ALWAYS_INLINE
+static inline void *
+_dispatch_queue_get_specific(dispatch_queue_t dq, const void *key)
 {
-	void **ctxtp = (void **)ctxt;
-	void *key = *ctxtp;
 	dispatch_queue_specific_queue_t dqsq =
-			(dispatch_queue_specific_queue_t)_dispatch_queue_get_current();
-	dispatch_queue_specific_t dqs;
+			(dispatch_queue_specific_queue_t)dq->dq_specific_q;
+	dispatch_queue_specific_list_t dqsl;
+	unsigned int i, count;
 
-	TAILQ_FOREACH(dqs, &dqsq->dqsq_contexts, dqs_list) {
-		if (dqs->dqs_key == key) {
-			*ctxtp = dqs->dqs_ctxt;
-			return;
+	if (fastpath(!dqsq) || !(dqsl = dqsq->dqsq_list)) {
+		return NULL;
+	}
+	count = dqsl->dqsl_count;
+	dispatch_atomic_acquire_barrier();
+	for (i = 0; i < count; i++) {
+		if (dqsl->dqsl_contexts[i].dqs_key == key) {
+			return dqsl->dqsl_contexts[i].dqs_ctxt;
 		}
 	}
-	*ctxtp = NULL;
+	return NULL;
 }
 
 DISPATCH_NOINLINE
@@ -1005,13 +1350,20 @@ dispatch_queue_get_specific(dispatch_queue_t dq, const void *key)
 	if (slowpath(!key)) {
 		return NULL;
 	}
-	void *ctxt = NULL;
+	return _dispatch_queue_get_specific(dq, key);
+}
 
-	if (fastpath(dq->dq_specific_q)) {
-		ctxt = (void *)key;
-		dispatch_sync_f(dq->dq_specific_q, &ctxt, _dispatch_queue_get_specific);
+DISPATCH_NOINLINE
+static dispatch_queue_specific_cache_t
+_dispatch_queue_specific_cache_create(void)
+{
+	dispatch_queue_specific_cache_t dqsc;
+
+	while (!(dqsc = calloc(1, sizeof(struct dispatch_queue_specific_cache_s)))) {
+		sleep(1);
 	}
-	return ctxt;
+	_dispatch_thread_setspecific(dispatch_specific_key, dqsc);
+	return dqsc;
 }
 
 DISPATCH_NOINLINE
@@ -1021,18 +1373,34 @@ dispatch_get_specific(const void *key)
 	if (slowpath(!key)) {
 		return NULL;
 	}
+	dispatch_queue_specific_cache_t dqsc = (dispatch_queue_specific_cache_t)
+			_dispatch_thread_getspecific(dispatch_specific_key);
+	unsigned long gen = _dispatch_queue_specific_gen;
 	void *ctxt = NULL;
-	dispatch_queue_t dq = _dispatch_queue_get_current();
+	dispatch_queue_t dq, cq = _dispatch_queue_get_current();
 
-	while (slowpath(dq)) {
-		if (slowpath(dq->dq_specific_q)) {
-			ctxt = (void *)key;
-			dispatch_sync_f(dq->dq_specific_q, &ctxt,
-					_dispatch_queue_get_specific);
-			if (ctxt) break;
+	if (slowpath(!cq)) {
+		return NULL;
+	}
+	dispatch_atomic_acquire_barrier();
+	if (slowpath(!dqsc)) {
+		dqsc = _dispatch_queue_specific_cache_create();
+	} else if (fastpath(dqsc->dqsc_queue == cq) &&
+			fastpath(dqsc->dqsc_key == key) &&
+			fastpath(dqsc->dqsc_gen == gen) &&
+			fastpath(dqsc->dqsc_serialnum == cq->dq_serialnum)) {
+		return dqsc->dqsc_ctxt;
+	}
+	for (dq = cq; dq; dq = dq->do_targetq) {
+		if ((ctxt = _dispatch_queue_get_specific(dq, key))) {
+			break;
 		}
-		dq = dq->do_targetq;
 	}
+	dqsc->dqsc_queue = cq;
+	dqsc->dqsc_serialnum = cq->dq_serialnum;
+	dqsc->dqsc_gen = gen;
+	dqsc->dqsc_key = key;
+	dqsc->dqsc_ctxt = ctxt;
 	return ctxt;
 }
 
@@ -1110,6 +1478,218 @@ _dispatch_queue_merge_stats(uint64_t start)
 #pragma mark -
 #pragma mark dispatch_continuation_t
 
+#ifndef DISPATCH_USE_CONTINUATION_SLAB
+#if HAVE_MALLOC_CREATE_ZONE
+#define DISPATCH_USE_CONTINUATION_SLAB 0
+#else
+#define DISPATCH_USE_CONTINUATION_SLAB 1
+#endif
+#endif
+
+#if DISPATCH_USE_CONTINUATION_SLAB
+#pragma mark -
+#pragma mark dispatch_continuation_slab
+
+// Continuations are carved as cacheline aligned slots out of large chunks of
+// anonymous memory. Each CPU has a slab head with the chunk it carves from and
+// a stack of magazines freed back to the slab (linked through dc_other of the
+// magazine heads). Slots are never returned to the system.
+
+#ifndef DISPATCH_CONTINUATION_SLAB_CHUNK_SIZE
+#define DISPATCH_CONTINUATION_SLAB_CHUNK_SIZE (2ul << 20)
+#endif
+#ifndef DISPATCH_CONTINUATION_SLAB_HEADS
+#define DISPATCH_CONTINUATION_SLAB_HEADS 16
+#endif
+// number of slots carved at once, the extra slots go to the thread cache
+#ifndef DISPATCH_CONTINUATION_SLAB_BATCH
+#define DISPATCH_CONTINUATION_SLAB_BATCH 16
+#endif
+// back chunks with transparent huge pages
+#ifndef DISPATCH_USE_SLAB_HUGEPAGES
+#define DISPATCH_USE_SLAB_HUGEPAGES 0
+#endif
+
+typedef struct dispatch_continuation_chunk_s {
+	uintptr_t volatile dcc_next;
+	uintptr_t dcc_end;
+} *dispatch_continuation_chunk_t;
+
+static struct dispatch_continuation_slab_s {
+	dispatch_continuation_chunk_t volatile dcs_chunk;
+	dispatch_continuation_t volatile dcs_free;
+	unsigned int volatile dcs_pop_lock;
+	size_t volatile dcs_carved_cnt;
+	size_t volatile dcs_free_cnt;
+} DISPATCH_CACHELINE_ALIGN
+		_dispatch_continuation_slabs[DISPATCH_CONTINUATION_SLAB_HEADS];
+
+DISPATCH_EXPORT DISPATCH_NOTHROW
+void _dispatch_continuation_slab_stats(size_t *live_slots, size_t *free_slots);
+
+DISPATCH_ALWAYS_INLINE
+static inline struct dispatch_continuation_slab_s *
+_dispatch_continuation_slab_head(void)
+{
+#if __linux__
+	int cpu = sched_getcpu();
+	if (fastpath(cpu >= 0)) {
+		return &_dispatch_continuation_slabs[
+				(unsigned int)cpu % DISPATCH_CONTINUATION_SLAB_HEADS];
+	}
+#endif
+	return &_dispatch_continuation_slabs[0];
+}
+
+static dispatch_continuation_chunk_t
+_dispatch_continuation_chunk_create(void)
+{
+	const size_t size = DISPATCH_CONTINUATION_SLAB_CHUNK_SIZE;
+	dispatch_continuation_chunk_t dcc;
+	char *p;
+
+#if DISPATCH_USE_SLAB_HUGEPAGES
+	// over-allocate so that the chunk can be aligned on a huge page boundary
+	char *map, *end;
+	while ((map = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED) {
+		sleep(1);
+	}
+	p = (char *)(((uintptr_t)map + size - 1) & ~(uintptr_t)(size - 1));
+	end = map + 2 * size;
+	if (p > map) {
+		(void)dispatch_assume_zero(munmap(map, (size_t)(p - map)));
+	}
+	if (p + size < end) {
+		(void)dispatch_assume_zero(munmap(p + size, (size_t)(end - p - size)));
+	}
+#ifdef MADV_HUGEPAGE
+	(void)madvise(p, size, MADV_HUGEPAGE);
+#endif
+#else
+	while ((p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED) {
+		sleep(1);
+	}
+#endif
+	// the chunk header takes the first slot
+	dcc = (dispatch_continuation_chunk_t)p;
+	dcc->dcc_next = (uintptr_t)p + DISPATCH_CONTINUATION_SLOT_SIZE;
+	dcc->dcc_end = (uintptr_t)p + size;
+	return dcc;
+}
+
+// Takes a magazine freed back to the slab and makes it the thread cache.
+// Pops are serialized by a try-lock, which makes the stack immune to ABA while
+// pushes stay lock-free. A thread that loses the race carves new slots instead.
+static dispatch_continuation_t
+_dispatch_continuation_slab_take(struct dispatch_continuation_slab_s *dcs)
+{
+	dispatch_continuation_t mag;
+
+	if (!dispatch_atomic_cmpxchg2o(dcs, dcs_pop_lock, 0, 1)) {
+		return NULL;
+	}
+	do {
+		mag = dcs->dcs_free;
+	} while (mag && !dispatch_atomic_cmpxchg2o(dcs, dcs_free, mag,
+			mag->dc_other));
+	dispatch_atomic_release_barrier();
+	dcs->dcs_pop_lock = 0;
+	if (!mag) {
+		return NULL;
+	}
+	(void)dispatch_atomic_sub2o(dcs, dcs_free_cnt, (size_t)mag->dc_cache_cnt);
+	_dispatch_thread_setspecific(dispatch_cache_key, mag->do_next);
+	return mag;
+}
+
+static dispatch_continuation_t
+_dispatch_continuation_alloc_from_heap(void)
+{
+	struct dispatch_continuation_slab_s *dcs;
+	dispatch_continuation_chunk_t dcc, new_dcc;
+	dispatch_continuation_t dc, next_dc = NULL;
+	const uintptr_t size = DISPATCH_CONTINUATION_SLOT_SIZE;
+	uintptr_t slot, end;
+	int cnt;
+
+	dcs = _dispatch_continuation_slab_head();
+	if (dcs->dcs_free && (dc = _dispatch_continuation_slab_take(dcs))) {
+		return dc;
+	}
+	for (;;) {
+		dcc = dcs->dcs_chunk;
+		if (fastpath(dcc)) {
+			slot = dispatch_atomic_add2o(dcc, dcc_next,
+					DISPATCH_CONTINUATION_SLAB_BATCH * size) -
+					DISPATCH_CONTINUATION_SLAB_BATCH * size;
+			if (fastpath(slot + size <= dcc->dcc_end)) {
+				end = slot + DISPATCH_CONTINUATION_SLAB_BATCH * size;
+				if (end > dcc->dcc_end) {
+					end = dcc->dcc_end;
+				}
+				(void)dispatch_atomic_add2o(dcs, dcs_carved_cnt,
+						(end - slot) / size);
+				// the first slot is returned, the others are linked into
+				// a magazine, deepest entry last
+				for (cnt = 1; (end -= size) > slot; cnt++) {
+					dc = (dispatch_continuation_t)end;
+					dc->dc_cache_cnt = cnt;
+					dc->do_next = next_dc;
+					next_dc = dc;
+				}
+				_dispatch_thread_setspecific(dispatch_cache_key, next_dc);
+				return (dispatch_continuation_t)slot;
+			}
+		}
+		new_dcc = _dispatch_continuation_chunk_create();
+		if (!dispatch_atomic_cmpxchg2o(dcs, dcs_chunk, dcc, new_dcc)) {
+			(void)dispatch_assume_zero(munmap(new_dcc,
+					DISPATCH_CONTINUATION_SLAB_CHUNK_SIZE));
+		}
+	}
+}
+
+static void
+_dispatch_continuation_free_to_heap(dispatch_continuation_t mag)
+{
+	struct dispatch_continuation_slab_s *dcs;
+	dispatch_continuation_t head;
+
+	if (!mag) {
+		return;
+	}
+	dcs = _dispatch_continuation_slab_head();
+	(void)dispatch_atomic_add2o(dcs, dcs_free_cnt, (size_t)mag->dc_cache_cnt);
+	do {
+		head = dcs->dcs_free;
+		mag->dc_other = head;
+	} while (!dispatch_atomic_cmpxchg2o(dcs, dcs_free, head, mag));
+}
+
+// Live slots are carved slots in use or cached by threads and the depot, free
+// slots are the ones freed back to the slab.
+void
+_dispatch_continuation_slab_stats(size_t *live_slots, size_t *free_slots)
+{
+	size_t carved = 0, free = 0;
+	unsigned int i;
+
+	for (i = 0; i < DISPATCH_CONTINUATION_SLAB_HEADS; i++) {
+		carved += _dispatch_continuation_slabs[i].dcs_carved_cnt;
+		free += _dispatch_continuation_slabs[i].dcs_free_cnt;
+	}
+	if (live_slots) {
+		*live_slots = carved - free;
+	}
+	if (free_slots) {
+		*free_slots = free;
+	}
+}
+
+#else // DISPATCH_USE_CONTINUATION_SLAB
+
 static malloc_zone_t *_dispatch_ccache_zone;
 
 static void
@@ -1120,7 +1700,7 @@ _dispatch_ccache_init(void *context DISPATCH_UNUSED)
 	malloc_set_zone_name(_dispatch_ccache_zone, "DispatchContinuations");
 }
 
-dispatch_continuation_t
+static dispatch_continuation_t
 _dispatch_continuation_alloc_from_heap(void)
 {
 	static dispatch_once_t pred;
@@ -1128,10 +1708,8 @@ _dispatch_continuation_alloc_from_heap(void)
 
 	dispatch_once_f(&pred, NULL, _dispatch_ccache_init);
 
-	// This is also used for allocating struct dispatch_apply_s. If the
-	// ROUND_UP behavior is changed, adjust the assert in libdispatch_init
 	while (!(dc = fastpath((dispatch_continuation_t)malloc_zone_calloc(
-	       _dispatch_ccache_zone, 1, ROUND_UP_TO_CACHELINE_SIZE(sizeof(*dc)))))) {
+	       _dispatch_ccache_zone, 1, DISPATCH_CONTINUATION_SLOT_SIZE)))) {
 		sleep(1);
 	}
 
@@ -1139,38 +1717,131 @@ _dispatch_continuation_alloc_from_heap(void)
 }
 
 static void
-_dispatch_force_cache_cleanup(void)
+_dispatch_continuation_free_to_heap(dispatch_continuation_t dc)
 {
-	dispatch_continuation_t dc;
-	dc = (dispatch_continuation_t)
-			_dispatch_thread_getspecific(dispatch_cache_key);
-	if (dc) {
-		_dispatch_thread_setspecific(dispatch_cache_key, NULL);
-		_dispatch_cache_cleanup(dc);
+	dispatch_continuation_t next_dc;
+
+	while (dc) {
+		next_dc = dc->do_next;
+		malloc_zone_free(_dispatch_ccache_zone, dc);
+		dc = next_dc;
 	}
 }
 
-// rdar://problem/11500155
-void
-dispatch_flush_continuation_cache(void)
-{
-	_dispatch_force_cache_cleanup();
-}
+#endif // DISPATCH_USE_CONTINUATION_SLAB
+
+#pragma mark -
+#pragma mark dispatch_continuation_depot
+
+// Magazines that threads hand back are parked in a fixed array of slots, so
+// that continuations freed by consumer threads get reused by producer threads
+// instead of going through malloc. Slots are claimed with a single atomic
+// operation, which keeps the depot lock-free without ABA issues. Magazines
+// that do not find a free slot are freed to the heap.
+
+#ifndef DISPATCH_CONTINUATION_DEPOT_LIMIT
+#define DISPATCH_CONTINUATION_DEPOT_LIMIT 32
+#endif
+
+static dispatch_continuation_t volatile
+		_dispatch_continuation_depot[DISPATCH_CONTINUATION_DEPOT_LIMIT];
+static unsigned int volatile _dispatch_continuation_depot_cnt;
 
-DISPATCH_NOINLINE
 static void
-_dispatch_cache_cleanup(void *value)
+_dispatch_continuation_depot_push(dispatch_continuation_t mag)
 {
-	dispatch_continuation_t dc, next_dc = (dispatch_continuation_t)value;
+	unsigned int i;
 
-	while ((dc = next_dc)) {
-		next_dc = dc->do_next;
-		malloc_zone_free(_dispatch_ccache_zone, dc);
+	for (i = 0; i < DISPATCH_CONTINUATION_DEPOT_LIMIT; i++) {
+		if (!_dispatch_continuation_depot[i] && dispatch_atomic_cmpxchg(
+				&_dispatch_continuation_depot[i], NULL, mag)) {
+			(void)dispatch_atomic_inc(&_dispatch_continuation_depot_cnt);
+			return;
+		}
 	}
+	_dispatch_continuation_free_to_heap(mag);
 }
 
-DISPATCH_ALWAYS_INLINE_NDEBUG
-static inline void
+static dispatch_continuation_t
+_dispatch_continuation_depot_pop(void)
+{
+	dispatch_continuation_t mag;
+	unsigned int i;
+
+	if (!_dispatch_continuation_depot_cnt) {
+		return NULL;
+	}
+	for (i = 0; i < DISPATCH_CONTINUATION_DEPOT_LIMIT; i++) {
+		if (_dispatch_continuation_depot[i] && (mag = dispatch_atomic_xchg(
+				&_dispatch_continuation_depot[i], NULL))) {
+			(void)dispatch_atomic_dec(&_dispatch_continuation_depot_cnt);
+			return mag;
+		}
+	}
+	return NULL;
+}
+
+dispatch_continuation_t
+_dispatch_continuation_alloc_slow(void)
+{
+	dispatch_continuation_t dc = _dispatch_continuation_depot_pop();
+
+	if (dc) {
+		_dispatch_thread_setspecific(dispatch_cache_key, dc->do_next);
+		return dc;
+	}
+	return _dispatch_continuation_alloc_from_heap();
+}
+
+// the thread magazine is full: hand it to the depot and start a new one
+void
+_dispatch_continuation_free_slow(dispatch_continuation_t dc)
+{
+	dispatch_continuation_t mag = (dispatch_continuation_t)
+			_dispatch_thread_getspecific(dispatch_cache_key);
+
+	dc->dc_cache_cnt = 1;
+	dc->do_next = NULL;
+	_dispatch_thread_setspecific(dispatch_cache_key, dc);
+	_dispatch_continuation_depot_push(mag);
+}
+
+static void
+_dispatch_force_cache_cleanup(void)
+{
+	dispatch_continuation_t dc;
+	dc = (dispatch_continuation_t)
+			_dispatch_thread_getspecific(dispatch_cache_key);
+	if (dc) {
+		_dispatch_thread_setspecific(dispatch_cache_key, NULL);
+		_dispatch_cache_cleanup(dc);
+	}
+}
+
+// rdar://problem/11500155
+void
+dispatch_flush_continuation_cache(void)
+{
+	dispatch_continuation_t dc;
+
+	dc = (dispatch_continuation_t)
+			_dispatch_thread_getspecific(dispatch_cache_key);
+	_dispatch_thread_setspecific(dispatch_cache_key, NULL);
+	_dispatch_continuation_free_to_heap(dc);
+	while ((dc = _dispatch_continuation_depot_pop())) {
+		_dispatch_continuation_free_to_heap(dc);
+	}
+}
+
+DISPATCH_NOINLINE
+static void
+_dispatch_cache_cleanup(void *value)
+{
+	_dispatch_continuation_depot_push((dispatch_continuation_t)value);
+}
+
+DISPATCH_ALWAYS_INLINE_NDEBUG
+static inline void
 _dispatch_continuation_redirect(dispatch_queue_t dq, dispatch_object_t dou)
 {
 	dispatch_continuation_t dc = dou._dc;
@@ -1191,13 +1862,19 @@ DISPATCH_ALWAYS_INLINE_NDEBUG
 static inline void
 _dispatch_continuation_pop(dispatch_object_t dou)
 {
-	dispatch_continuation_t dc = dou._dc;
+	dispatch_continuation_t dc = dou._dc, dci;
 	dispatch_group_t dg;
 
 	_dispatch_trace_continuation_pop(_dispatch_queue_get_current(), dou);
 	if (DISPATCH_OBJ_IS_VTABLE(dou._do)) {
 		return _dispatch_queue_invoke(dou._dq);
 	}
+	// the context lives in the continuation, so it is freed last
+	if (slowpath((long)dc->do_vtable & DISPATCH_OBJ_INLINE_BIT)) {
+		dci = dc;
+	} else {
+		dci = NULL;
+	}
 
 	// Add the item back to the cache before calling the function. This
 	// allows the 'hot' continuation to be used for a quick callback.
@@ -1218,6 +1895,357 @@ _dispatch_continuation_pop(dispatch_object_t dou)
 		dispatch_group_leave(dg);
 		_dispatch_release(dg);
 	}
+	if (slowpath(dci)) {
+		_dispatch_continuation_free(dci);
+	}
+}
+
+#pragma mark -
+#pragma mark dispatch_queue_capacity
+
+// Blocked producers wait until the queue has drained below the low-water mark
+#ifndef DISPATCH_QUEUE_CAPACITY_LOW_WATER
+#define DISPATCH_QUEUE_CAPACITY_LOW_WATER(capacity) \
+		((capacity) - (capacity) / 2)
+#endif
+
+static dispatch_queue_capacity_t
+_dispatch_queue_capacity_create(dispatch_queue_attr_t dqa)
+{
+	dispatch_queue_capacity_t dqc;
+
+	while (!(dqc = calloc(1, sizeof(struct dispatch_queue_capacity_s)))) {
+		sleep(1);
+	}
+	dqc->dqc_limit = dqa->dqa_capacity;
+	dqc->dqc_low_water = DISPATCH_QUEUE_CAPACITY_LOW_WATER(dqa->dqa_capacity);
+	dqc->dqc_overflow = dqa->dqa_overflow;
+#if !DISPATCH_USE_FUTEX
+	dqc->dqc_sema = dispatch_semaphore_create(0);
+#endif
+	return dqc;
+}
+
+static void
+_dispatch_queue_capacity_dispose(dispatch_queue_capacity_t dqc)
+{
+#if !DISPATCH_USE_FUTEX
+	dispatch_release(dqc->dqc_sema);
+#endif
+	free(dqc);
+}
+
+DISPATCH_NOINLINE
+static void
+_dispatch_queue_capacity_wait(dispatch_queue_capacity_t dqc)
+{
+	int32_t gen = dqc->dqc_gen;
+
+	(void)dispatch_atomic_inc2o(dqc, dqc_waiters);
+	// The drain wakes up waiters once it crosses the low-water mark, the
+	// generation changes if it did since it was read above
+	if (dqc->dqc_depth >= dqc->dqc_low_water) {
+#if DISPATCH_USE_FUTEX
+		(void)_dispatch_futex_wait(&dqc->dqc_gen, gen, NULL);
+#else
+		(void)gen;
+		(void)dispatch_semaphore_wait(dqc->dqc_sema, DISPATCH_TIME_FOREVER);
+#endif
+	}
+	(void)dispatch_atomic_dec2o(dqc, dqc_waiters);
+}
+
+DISPATCH_NOINLINE
+static void
+_dispatch_queue_capacity_wake(dispatch_queue_capacity_t dqc)
+{
+	(void)dispatch_atomic_inc2o(dqc, dqc_gen);
+#if DISPATCH_USE_FUTEX
+	(void)_dispatch_futex_wake(&dqc->dqc_gen, INT32_MAX);
+#else
+	int32_t n = dqc->dqc_waiters;
+	while (n-- > 0) {
+		(void)dispatch_semaphore_signal(dqc->dqc_sema);
+	}
+#endif
+}
+
+// Counts a submission to a queue with a capacity, returns non-zero if the
+// queue is full and the submission must fail.
+static long
+_dispatch_queue_capacity_reserve(dispatch_queue_t dq, bool try)
+{
+	dispatch_queue_capacity_t dqc = dq->dq_capacity;
+	dispatch_queue_t cq;
+	size_t depth;
+
+	if (dqc->dqc_overflow == DISPATCH_QUEUE_OVERFLOW_DROP_OLDEST) {
+		// the drain drops the items past the capacity
+		(void)dispatch_atomic_inc2o(dqc, dqc_depth);
+		return 0;
+	}
+	for (;;) {
+		depth = dqc->dqc_depth;
+		if (fastpath(depth < dqc->dqc_limit)) {
+			if (dispatch_atomic_cmpxchg2o(dqc, dqc_depth, depth, depth + 1)) {
+				return 0;
+			}
+			continue;
+		}
+		if (try) {
+			return ENOBUFS;
+		}
+		// Only dispatch_async_try_f() can fail, and the queue cannot drain
+		// while an item of its own or of a queue targeting it waits for it.
+		// The manager thread never blocks, timers and sources depend on it.
+		cq = NULL;
+		if (dqc->dqc_overflow == DISPATCH_QUEUE_OVERFLOW_BLOCK) {
+			cq = _dispatch_queue_get_current();
+			if (cq != &_dispatch_mgr_q) {
+				for (; cq && cq != dq; cq = cq->do_targetq);
+			}
+		}
+		if (dqc->dqc_overflow == DISPATCH_QUEUE_OVERFLOW_FAIL ||
+				slowpath(cq)) {
+			(void)dispatch_atomic_inc2o(dqc, dqc_depth);
+			return 0;
+		}
+		_dispatch_queue_capacity_wait(dqc);
+	}
+}
+
+// Uncounts an item popped by the drain, returns true if it must be dropped
+DISPATCH_ALWAYS_INLINE
+static inline bool
+_dispatch_queue_capacity_pop(dispatch_queue_capacity_t dqc)
+{
+	size_t depth = dispatch_atomic_dec2o(dqc, dqc_depth);
+
+	if (slowpath(dqc->dqc_waiters) && depth < dqc->dqc_low_water) {
+		_dispatch_queue_capacity_wake(dqc);
+	}
+	return slowpath(dqc->dqc_overflow == DISPATCH_QUEUE_OVERFLOW_DROP_OLDEST)
+			&& depth >= dqc->dqc_limit;
+}
+
+static void _dispatch_async_inline_invoke_and_free(void *ctxt);
+
+// Discards an item without invoking it
+static void
+_dispatch_continuation_drop(dispatch_continuation_t dc)
+{
+	dispatch_group_t dg = NULL;
+
+	if ((long)dc->do_vtable & DISPATCH_OBJ_GROUP_BIT) {
+		dg = (dispatch_group_t)dc->dc_data;
+	}
+#ifdef __BLOCKS__
+	if (dc->dc_func == _dispatch_call_block_and_release) {
+		Block_release(dc->dc_ctxt);
+	}
+#endif
+	if (dc->dc_func == _dispatch_async_inline_invoke_and_free) {
+		free(dc->dc_ctxt);
+	}
+	_dispatch_continuation_free(dc);
+	if (dg) {
+		dispatch_group_leave(dg);
+		_dispatch_release(dg);
+	}
+}
+
+#pragma mark -
+#pragma mark dispatch_queue_stats
+
+#ifndef DISPATCH_QUEUE_STATS_SHARDS
+#define DISPATCH_QUEUE_STATS_SHARDS 16
+#endif
+
+static void
+_dispatch_queue_stats_init(void)
+{
+	_dispatch_queue_stats_default = getenv("LIBDISPATCH_QUEUE_STATS");
+}
+
+void
+dispatch_queue_enable_stats(dispatch_queue_t dq)
+{
+	dispatch_queue_stats_shards_t dqst;
+	unsigned int count = _dispatch_hw_config.cc_max_logical;
+	size_t size;
+	void *buf;
+
+	if (slowpath(dq->do_ref_cnt == DISPATCH_OBJECT_GLOBAL_REFCNT) ||
+			dq->dq_stats) {
+		return;
+	}
+	if (count > DISPATCH_QUEUE_STATS_SHARDS) {
+		count = DISPATCH_QUEUE_STATS_SHARDS;
+	} else if (!count) {
+		count = 1;
+	}
+	size = sizeof(struct dispatch_queue_stats_shards_s) +
+			count * sizeof(struct dispatch_queue_stats_shard_s);
+	while (slowpath(posix_memalign(&buf, DISPATCH_CACHELINE_SIZE, size))) {
+		sleep(1);
+	}
+	memset(buf, 0, size);
+	dqst = buf;
+	dqst->dqst_count = count;
+	if (!dispatch_atomic_cmpxchg2o(dq, dq_stats, NULL, dqst)) {
+		free(dqst);
+	}
+}
+
+static void
+_dispatch_queue_stats_dispose(dispatch_queue_stats_shards_t dqst)
+{
+	free(dqst);
+}
+
+long
+dispatch_queue_get_stats(dispatch_queue_t dq,
+		struct dispatch_queue_stats_s *stats)
+{
+	dispatch_queue_stats_shards_t dqst = dq->dq_stats;
+	struct dispatch_queue_stats_shard_s *dqss;
+	unsigned int i, j;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!dqst) {
+		return ENOTSUP;
+	}
+	for (i = 0; i < dqst->dqst_count; i++) {
+		dqss = &dqst->dqst_shards[i];
+		stats->enqueued += dqss->dqss_enqueued;
+		stats->dequeued += dqss->dqss_dequeued;
+		for (j = 0; j < DISPATCH_QUEUE_STATS_BUCKETS; j++) {
+			stats->latency[j] += dqss->dqss_latency[j];
+			stats->execution[j] += dqss->dqss_execution[j];
+		}
+	}
+	// the shards are read one after the other, an item may have been
+	// dequeued from a shard already read and enqueued to a later one
+	if (stats->enqueued > stats->dequeued) {
+		stats->depth = stats->enqueued - stats->dequeued;
+	}
+	return 0;
+}
+
+DISPATCH_ALWAYS_INLINE
+static inline struct dispatch_queue_stats_shard_s *
+_dispatch_queue_stats_shard(dispatch_queue_stats_shards_t dqst)
+{
+#if __linux__
+	int cpu = sched_getcpu();
+	if (fastpath(cpu >= 0)) {
+		return &dqst->dqst_shards[(unsigned int)cpu % dqst->dqst_count];
+	}
+#endif
+	return &dqst->dqst_shards[0];
+}
+
+// Bucket i holds durations in [2^(i-1), 2^i) nanoseconds
+DISPATCH_ALWAYS_INLINE
+static inline unsigned int
+_dispatch_queue_stats_bucket(uint64_t delta)
+{
+	unsigned int bucket;
+
+	delta = _dispatch_time_mach2nano(delta);
+	bucket = delta ? 64 - (unsigned int)__builtin_clzll(delta) : 0;
+	return bucket < DISPATCH_QUEUE_STATS_BUCKETS ? bucket :
+			DISPATCH_QUEUE_STATS_BUCKETS - 1;
+}
+
+// Work items submitted by clients, as opposed to queues, sources, sync
+// waiters and redirections of the items of other queues
+DISPATCH_ALWAYS_INLINE
+static inline bool
+_dispatch_queue_stats_counted(struct dispatch_object_s *dou)
+{
+	dispatch_continuation_t dc = (dispatch_continuation_t)dou;
+
+	return !DISPATCH_OBJ_IS_VTABLE(dou) && ((long)dc->do_vtable &
+			(DISPATCH_OBJ_ASYNC_BIT | DISPATCH_OBJ_INLINE_BIT)) &&
+			dc->dc_func != _dispatch_async_f_redirect_invoke;
+}
+
+// Counts the items of a list about to be pushed, and stamps them with the
+// enqueue time unless dc_other holds inline arguments
+void
+_dispatch_queue_stats_push(dispatch_queue_t dq, struct dispatch_object_s *head,
+		struct dispatch_object_s *tail)
+{
+	struct dispatch_object_s *dou = head;
+	dispatch_continuation_t dc;
+	uintptr_t now = 0;
+	uint64_t n = 0;
+
+	for (;;) {
+		if (_dispatch_queue_stats_counted(dou)) {
+			dc = (dispatch_continuation_t)dou;
+			if (!((long)dc->do_vtable & DISPATCH_OBJ_INLINE_BIT)) {
+				if (!now) {
+					now = (uintptr_t)_dispatch_absolute_time();
+				}
+				dc->dc_other = (void *)now;
+				dc->do_vtable = (void *)((long)dc->do_vtable |
+						DISPATCH_OBJ_STATS_BIT);
+			}
+			n++;
+		}
+		if (dou == tail) {
+			break;
+		}
+		dou = dou->do_next;
+	}
+	if (n) {
+		(void)dispatch_atomic_add(&_dispatch_queue_stats_shard(dq->dq_stats)->
+				dqss_enqueued, n);
+	}
+}
+
+// Pops an item of a queue with statistics, the continuation may be reused as
+// soon as it is popped
+DISPATCH_NOINLINE
+static void
+_dispatch_queue_stats_pop(dispatch_queue_t dq, struct dispatch_object_s *dou)
+{
+	dispatch_queue_stats_shards_t dqst = dq->dq_stats;
+	struct dispatch_queue_stats_shard_s *dqss;
+	dispatch_continuation_t dc = (dispatch_continuation_t)dou;
+	uint64_t start;
+	uintptr_t stamp;
+	long vtable;
+
+	if (!_dispatch_queue_stats_counted(dou)) {
+		return _dispatch_continuation_pop(dou);
+	}
+	vtable = (long)dc->do_vtable;
+	stamp = (uintptr_t)dc->dc_other;
+	start = _dispatch_absolute_time();
+	dqss = _dispatch_queue_stats_shard(dqst);
+	(void)dispatch_atomic_inc(&dqss->dqss_dequeued);
+	if (vtable & DISPATCH_OBJ_STATS_BIT) {
+		// the stamp is truncated to the width of a pointer
+		(void)dispatch_atomic_inc(&dqss->dqss_latency[
+				_dispatch_queue_stats_bucket((uintptr_t)start - stamp)]);
+	}
+	_dispatch_continuation_pop(dou);
+	dqss = _dispatch_queue_stats_shard(dqst);
+	(void)dispatch_atomic_inc(&dqss->dqss_execution[
+			_dispatch_queue_stats_bucket(_dispatch_absolute_time() - start)]);
+}
+
+// Counts an item discarded by a queue with a capacity
+static void
+_dispatch_queue_stats_drop(dispatch_queue_t dq, struct dispatch_object_s *dou)
+{
+	if (_dispatch_queue_stats_counted(dou)) {
+		(void)dispatch_atomic_inc(
+				&_dispatch_queue_stats_shard(dq->dq_stats)->dqss_dequeued);
+	}
 }
 
 #pragma mark -
@@ -1226,36 +2254,60 @@ _dispatch_continuation_pop(dispatch_object_t dou)
 DISPATCH_NOINLINE
 static void
 _dispatch_barrier_async_f_slow(dispatch_queue_t dq, void *ctxt,
-		dispatch_function_t func)
+		dispatch_function_t func, long vtable)
 {
-	dispatch_continuation_t dc = _dispatch_continuation_alloc_from_heap();
+	dispatch_continuation_t dc = _dispatch_continuation_alloc_slow();
 
-	dc->do_vtable = (void *)(DISPATCH_OBJ_ASYNC_BIT | DISPATCH_OBJ_BARRIER_BIT);
+	dc->do_vtable = (void *)vtable;
 	dc->dc_func = func;
 	dc->dc_ctxt = ctxt;
 
 	_dispatch_queue_push(dq, dc);
 }
 
-DISPATCH_NOINLINE
-void
-dispatch_barrier_async_f(dispatch_queue_t dq, void *ctxt,
-		dispatch_function_t func)
+DISPATCH_ALWAYS_INLINE
+static inline void
+_dispatch_barrier_async_f2(dispatch_queue_t dq, void *ctxt,
+		dispatch_function_t func, long vtable)
 {
 	dispatch_continuation_t dc;
 
 	dc = fastpath(_dispatch_continuation_alloc_cacheonly());
 	if (!dc) {
-		return _dispatch_barrier_async_f_slow(dq, ctxt, func);
+		return _dispatch_barrier_async_f_slow(dq, ctxt, func, vtable);
 	}
 
-	dc->do_vtable = (void *)(DISPATCH_OBJ_ASYNC_BIT | DISPATCH_OBJ_BARRIER_BIT);
+	dc->do_vtable = (void *)vtable;
 	dc->dc_func = func;
 	dc->dc_ctxt = ctxt;
 
 	_dispatch_queue_push(dq, dc);
 }
 
+DISPATCH_NOINLINE
+void
+dispatch_barrier_async_f(dispatch_queue_t dq, void *ctxt,
+		dispatch_function_t func)
+{
+	long vtable = DISPATCH_OBJ_ASYNC_BIT | DISPATCH_OBJ_BARRIER_BIT;
+
+	if (slowpath(dq->dq_capacity)) {
+		(void)_dispatch_queue_capacity_reserve(dq, false);
+		vtable |= DISPATCH_OBJ_BOUNDED_BIT;
+	}
+	_dispatch_barrier_async_f2(dq, ctxt, func, vtable);
+}
+
+// Not counted against the capacity of the queue, for internal use
+DISPATCH_NOINLINE
+static void
+_dispatch_barrier_async_detached_f(dispatch_queue_t dq, void *ctxt,
+		dispatch_function_t func)
+{
+	_dispatch_barrier_async_f2(dq, ctxt, func,
+			DISPATCH_OBJ_ASYNC_BIT | DISPATCH_OBJ_BARRIER_BIT);
+}
+
 #ifdef __BLOCKS__
 void
 dispatch_barrier_async(dispatch_queue_t dq, void (^work)(void))
@@ -1278,7 +2330,11 @@ _dispatch_async_f_redirect_invoke(void *_ctxt)
 
 	old_dq = (dispatch_queue_t)_dispatch_thread_getspecific(dispatch_queue_key);
 	_dispatch_thread_setspecific(dispatch_queue_key, dq);
-	_dispatch_continuation_pop(other_dc);
+	if (slowpath(dq->dq_stats)) {
+		_dispatch_queue_stats_pop(dq, (struct dispatch_object_s *)other_dc);
+	} else {
+		_dispatch_continuation_pop(other_dc);
+	}
 	_dispatch_thread_setspecific(dispatch_queue_key, old_dq);
 
 	rq = dq->do_targetq;
@@ -1340,6 +2396,11 @@ _dispatch_async_f_redirect(dispatch_queue_t dq,
 		}
 		rq = rq->do_targetq;
 	}
+#if DISPATCH_USE_WORK_STEALING
+	if (_dispatch_worker_deque_push(rq, dc)) {
+		return;
+	}
+#endif
 	_dispatch_queue_push(rq, dc);
 }
 
@@ -1352,7 +2413,8 @@ _dispatch_async_f2(dispatch_queue_t dq, dispatch_continuation_t dc)
 
 	do {
 		if (slowpath(dq->dq_items_tail)
-				|| slowpath(DISPATCH_OBJECT_SUSPENDED(dq))) {
+				|| slowpath(DISPATCH_OBJECT_SUSPENDED(dq))
+				|| slowpath(dq->dq_stats)) {
 			break;
 		}
 		running = dispatch_atomic_add2o(dq, dq_running, 2);
@@ -1378,7 +2440,7 @@ static void
 _dispatch_async_f_slow(dispatch_queue_t dq, void *ctxt,
 		dispatch_function_t func)
 {
-	dispatch_continuation_t dc = _dispatch_continuation_alloc_from_heap();
+	dispatch_continuation_t dc = _dispatch_continuation_alloc_slow();
 
 	dc->do_vtable = (void *)DISPATCH_OBJ_ASYNC_BIT;
 	dc->dc_func = func;
@@ -1389,6 +2451,11 @@ _dispatch_async_f_slow(dispatch_queue_t dq, void *ctxt,
 		return _dispatch_async_f2(dq, dc);
 	}
 
+#if DISPATCH_USE_WORK_STEALING
+	if (_dispatch_worker_deque_push(dq, dc)) {
+		return;
+	}
+#endif
 	_dispatch_queue_push(dq, dc);
 }
 
@@ -1417,6 +2484,11 @@ dispatch_async_f(dispatch_queue_t dq, void *ctxt, dispatch_function_t func)
 		return _dispatch_async_f2(dq, dc);
 	}
 
+#if DISPATCH_USE_WORK_STEALING
+	if (_dispatch_worker_deque_push(dq, dc)) {
+		return;
+	}
+#endif
 	_dispatch_queue_push(dq, dc);
 }
 
@@ -1429,6 +2501,192 @@ dispatch_async(dispatch_queue_t dq, void (^work)(void))
 }
 #endif
 
+long
+dispatch_async_try_f(dispatch_queue_t dq, void *ctxt, dispatch_function_t func)
+{
+	if (fastpath(!dq->dq_capacity)) {
+		dispatch_async_f(dq, ctxt, func);
+		return 0;
+	}
+	if (_dispatch_queue_capacity_reserve(dq, true)) {
+		return ENOBUFS;
+	}
+	_dispatch_barrier_async_f2(dq, ctxt, func, DISPATCH_OBJ_ASYNC_BIT |
+			DISPATCH_OBJ_BARRIER_BIT | DISPATCH_OBJ_BOUNDED_BIT);
+	return 0;
+}
+
+#pragma mark -
+#pragma mark dispatch_async_inline
+
+struct dispatch_async_inline_args_s {
+	dispatch_function_t daia_func;
+	void *daia_args[];
+};
+
+static void
+_dispatch_async_inline_invoke_and_free(void *ctxt)
+{
+	struct dispatch_async_inline_args_s *daia = ctxt;
+
+	_dispatch_client_callout(daia->daia_args, daia->daia_func);
+	free(daia);
+}
+
+// the arguments do not fit in a continuation, copy them to the heap
+DISPATCH_NOINLINE
+static void
+_dispatch_async_inline_f_slow(dispatch_queue_t dq, dispatch_function_t func,
+		const void *args, size_t len)
+{
+	struct dispatch_async_inline_args_s *daia;
+
+	while (!(daia = malloc(sizeof(*daia) + len))) {
+		sleep(1);
+	}
+	daia->daia_func = func;
+	memcpy(daia->daia_args, args, len);
+	dispatch_async_f(dq, daia, _dispatch_async_inline_invoke_and_free);
+}
+
+DISPATCH_NOINLINE
+void
+dispatch_async_inline_f(dispatch_queue_t dq, dispatch_function_t func,
+		const void *args, size_t len)
+{
+	dispatch_continuation_t dc;
+
+	if (slowpath(len > DISPATCH_CONTINUATION_INLINE_SIZE)) {
+		return _dispatch_async_inline_f_slow(dq, func, args, len);
+	}
+
+	dc = _dispatch_continuation_alloc();
+	dc->dc_func = func;
+	dc->dc_ctxt = _dispatch_continuation_inline_args(dc);
+	if (len) {
+		memcpy(dc->dc_ctxt, args, len);
+	}
+
+	// No fastpath/slowpath hint because we simply don't know
+	if (dq->dq_width == 1) {
+		long vtable = DISPATCH_OBJ_INLINE_BIT | DISPATCH_OBJ_BARRIER_BIT;
+
+		if (slowpath(dq->dq_capacity)) {
+			(void)_dispatch_queue_capacity_reserve(dq, false);
+			vtable |= DISPATCH_OBJ_BOUNDED_BIT;
+		}
+		dc->do_vtable = (void *)vtable;
+		return _dispatch_queue_push(dq, dc);
+	}
+	dc->do_vtable = (void *)DISPATCH_OBJ_INLINE_BIT;
+
+	// No fastpath/slowpath hint because we simply don't know
+	if (dq->do_targetq) {
+		return _dispatch_async_f2(dq, dc);
+	}
+
+#if DISPATCH_USE_WORK_STEALING
+	if (_dispatch_worker_deque_push(dq, dc)) {
+		return;
+	}
+#endif
+	_dispatch_queue_push(dq, dc);
+}
+
+#pragma mark -
+#pragma mark dispatch_async_batch
+
+// Publishes a locally built chain of continuations with a single exchange on
+// the queue tail and wakes up to one thread per active CPU.
+DISPATCH_ALWAYS_INLINE
+static inline void
+_dispatch_async_batch_push(dispatch_queue_t dq, dispatch_continuation_t head,
+		dispatch_continuation_t tail, size_t count)
+{
+	unsigned int n = _dispatch_hw_config.cc_max_active;
+
+	if (count < n) {
+		n = (unsigned int)count;
+	}
+	_dispatch_queue_push_list(dq, head, tail, n);
+}
+
+DISPATCH_NOINLINE
+void
+dispatch_async_batch_f(dispatch_queue_t dq, size_t count,
+		void *const contexts[], dispatch_function_t func)
+{
+	dispatch_continuation_t dc, head = NULL, tail = NULL;
+	long vtable = DISPATCH_OBJ_ASYNC_BIT;
+	size_t i;
+
+	if (slowpath(!count)) {
+		return;
+	}
+	if (slowpath(dq->dq_capacity)) {
+		// each item is counted against the capacity
+		for (i = 0; i < count; i++) {
+			dispatch_barrier_async_f(dq, contexts[i], func);
+		}
+		return;
+	}
+	// like dispatch_async_f(), serial queues get barrier continuations
+	if (dq->dq_width == 1) {
+		vtable |= DISPATCH_OBJ_BARRIER_BIT;
+	}
+	for (i = 0; i < count; i++) {
+		dc = _dispatch_continuation_alloc();
+		dc->do_vtable = (void *)vtable;
+		dc->dc_func = func;
+		dc->dc_ctxt = contexts[i];
+		if (tail) {
+			tail->do_next = dc;
+		} else {
+			head = dc;
+		}
+		tail = dc;
+	}
+	_dispatch_async_batch_push(dq, head, tail, count);
+}
+
+#ifdef __BLOCKS__
+void
+dispatch_async_batch(dispatch_queue_t dq, size_t count,
+		dispatch_block_t const blocks[])
+{
+	dispatch_continuation_t dc, head = NULL, tail = NULL;
+	long vtable = DISPATCH_OBJ_ASYNC_BIT;
+	size_t i;
+
+	if (slowpath(!count)) {
+		return;
+	}
+	if (slowpath(dq->dq_capacity)) {
+		for (i = 0; i < count; i++) {
+			dispatch_barrier_async_f(dq, _dispatch_Block_copy(blocks[i]),
+					_dispatch_call_block_and_release);
+		}
+		return;
+	}
+	if (dq->dq_width == 1) {
+		vtable |= DISPATCH_OBJ_BARRIER_BIT;
+	}
+	for (i = 0; i < count; i++) {
+		dc = _dispatch_continuation_alloc();
+		dc->do_vtable = (void *)vtable;
+		dc->dc_func = _dispatch_call_block_and_release;
+		dc->dc_ctxt = _dispatch_Block_copy(blocks[i]);
+		if (tail) {
+			tail->do_next = dc;
+		} else {
+			head = dc;
+		}
+		tail = dc;
+	}
+	_dispatch_async_batch_push(dq, head, tail, count);
+}
+#endif
+
 #pragma mark -
 #pragma mark dispatch_group_async
 
@@ -1449,6 +2707,12 @@ dispatch_group_async_f(dispatch_group_t dg, dispatch_queue_t dq, void *ctxt,
 	dc->dc_ctxt = ctxt;
 	dc->dc_data = dg;
 
+	if (slowpath(dq->dq_capacity)) {
+		(void)_dispatch_queue_capacity_reserve(dq, false);
+		dc->do_vtable = (void *)((long)dc->do_vtable |
+				DISPATCH_OBJ_BOUNDED_BIT);
+	}
+
 	// No fastpath/slowpath hint because we simply don't know
 	if (dq->dq_width != 1 && dq->do_targetq) {
 		return _dispatch_async_f2(dq, dc);
@@ -1510,6 +2774,89 @@ _dispatch_function_recurse(dispatch_queue_t dq, void *ctxt,
 	dispatch_sync_f(dq->do_targetq, &dfr, _dispatch_function_recurse_invoke);
 }
 
+#pragma mark -
+#pragma mark dispatch_sync_spin
+
+// Before parking, a sync caller that finds the queue busy spins with
+// exponential backoff for up to a per queue budget, waiting for the queue to
+// become free. The budget tracks twice the observed wait when the queue is
+// acquired while spinning and is halved when it is not, so that callers of
+// queues running long work items park almost immediately.
+
+#ifndef DISPATCH_SYNC_SPINS
+#define DISPATCH_SYNC_SPINS 4000
+#endif
+#ifndef DISPATCH_SYNC_SPINS_MIN
+#define DISPATCH_SYNC_SPINS_MIN 32
+#endif
+#ifndef DISPATCH_SYNC_BACKOFF_MAX
+#define DISPATCH_SYNC_BACKOFF_MAX 64
+#endif
+
+// Returns true if the queue was acquired, for a barrier when barrier is set
+DISPATCH_NOINLINE
+static bool
+_dispatch_sync_spin(dispatch_queue_t dq, bool barrier)
+{
+	unsigned long limit = dq->dq_sync_spin, spins = 0, pause = 1, i;
+	bool acquired = false;
+
+	if (slowpath(_dispatch_hw_config.cc_max_active < 2) ||
+			slowpath(!dq->do_targetq) || dq == &_dispatch_main_q) {
+		// nobody can release the queue while we spin, or the queue is never
+		// acquired by callers of dispatch_sync
+		return false;
+	}
+	if (!limit) {
+		limit = DISPATCH_SYNC_SPINS;
+	}
+	while (spins < limit) {
+		for (i = pause; i; i--) {
+			_dispatch_hardware_pause();
+		}
+		spins += pause;
+		if (slowpath(DISPATCH_OBJECT_SUSPENDED(dq))) {
+			break;
+		}
+		// items ahead of the caller must be invoked first
+		if (!dq->dq_items_tail) {
+			if (barrier) {
+				if (!dq->dq_running &&
+						dispatch_atomic_cmpxchg2o(dq, dq_running, 0, 1)) {
+					acquired = true;
+					break;
+				}
+			} else if (!(dq->dq_running & 1)) {
+				if (!(dispatch_atomic_add2o(dq, dq_running, 2) & 1)) {
+					acquired = true;
+					break;
+				}
+				if (dispatch_atomic_sub2o(dq, dq_running, 2) == 0) {
+					_dispatch_wakeup(dq);
+				}
+			}
+		}
+		if (pause < DISPATCH_SYNC_BACKOFF_MAX) {
+			pause <<= 1;
+		}
+	}
+	if (acquired) {
+		// Move the budget 1/8th of the way towards twice the wait
+		limit = limit - limit / 8 + spins / 4;
+	} else {
+		limit /= 2;
+	}
+	if (limit < DISPATCH_SYNC_SPINS_MIN) {
+		limit = DISPATCH_SYNC_SPINS_MIN;
+	} else if (limit > DISPATCH_SYNC_SPINS) {
+		limit = DISPATCH_SYNC_SPINS;
+	}
+	if (limit != dq->dq_sync_spin) {
+		dq->dq_sync_spin = limit;
+	}
+	return acquired;
+}
+
 #pragma mark -
 #pragma mark dispatch_barrier_sync
 
@@ -1708,13 +3055,13 @@ dispatch_barrier_sync_f(dispatch_queue_t dq, void *ctxt,
 {
 	// 1) ensure that this thread hasn't enqueued anything ahead of this call
 	// 2) the queue is not suspended
-	if (slowpath(dq->dq_items_tail) || slowpath(DISPATCH_OBJECT_SUSPENDED(dq))){
-		return _dispatch_barrier_sync_f_slow(dq, ctxt, func);
-	}
-	if (slowpath(!dispatch_atomic_cmpxchg2o(dq, dq_running, 0, 1))) {
+	if (slowpath(dq->dq_items_tail) || slowpath(DISPATCH_OBJECT_SUSPENDED(dq)) ||
+			slowpath(!dispatch_atomic_cmpxchg2o(dq, dq_running, 0, 1))) {
 		// global queues and main queue bound to main thread always falls into
 		// the slow case
-		return _dispatch_barrier_sync_f_slow(dq, ctxt, func);
+		if (!_dispatch_sync_spin(dq, true)) {
+			return _dispatch_barrier_sync_f_slow(dq, ctxt, func);
+		}
 	}
 	if (slowpath(dq->do_targetq->do_targetq)) {
 		return _dispatch_barrier_sync_f_recurse(dq, ctxt, func);
@@ -1788,17 +3135,6 @@ _dispatch_sync_f_slow(dispatch_queue_t dq, void *ctxt, dispatch_function_t func)
 	}
 }
 
-DISPATCH_NOINLINE
-static void
-_dispatch_sync_f_slow2(dispatch_queue_t dq, void *ctxt,
-		dispatch_function_t func)
-{
-	if (slowpath(dispatch_atomic_sub2o(dq, dq_running, 2) == 0)) {
-		_dispatch_wakeup(dq);
-	}
-	_dispatch_sync_f_slow(dq, ctxt, func);
-}
-
 DISPATCH_NOINLINE
 static void
 _dispatch_sync_f_invoke(dispatch_queue_t dq, void *ctxt,
@@ -1828,10 +3164,16 @@ _dispatch_sync_f2(dispatch_queue_t dq, void *ctxt, dispatch_function_t func)
 	// 1) ensure that this thread hasn't enqueued anything ahead of this call
 	// 2) the queue is not suspended
 	if (slowpath(dq->dq_items_tail) || slowpath(DISPATCH_OBJECT_SUSPENDED(dq))){
-		return _dispatch_sync_f_slow(dq, ctxt, func);
-	}
-	if (slowpath(dispatch_atomic_add2o(dq, dq_running, 2) & 1)) {
-		return _dispatch_sync_f_slow2(dq, ctxt, func);
+		if (!_dispatch_sync_spin(dq, false)) {
+			return _dispatch_sync_f_slow(dq, ctxt, func);
+		}
+	} else if (slowpath(dispatch_atomic_add2o(dq, dq_running, 2) & 1)) {
+		if (slowpath(dispatch_atomic_sub2o(dq, dq_running, 2) == 0)) {
+			_dispatch_wakeup(dq);
+		}
+		if (!_dispatch_sync_spin(dq, false)) {
+			return _dispatch_sync_f_slow(dq, ctxt, func);
+		}
 	}
 	if (slowpath(dq->do_targetq->do_targetq)) {
 		return _dispatch_sync_f_recurse(dq, ctxt, func);
@@ -1889,35 +3231,12 @@ dispatch_sync(dispatch_queue_t dq, void (^work)(void))
 #pragma mark -
 #pragma mark dispatch_after
 
-struct _dispatch_after_time_s {
-	void *datc_ctxt;
-	void (*datc_func)(void *);
-	dispatch_source_t ds;
-};
-
-static void
-_dispatch_after_timer_callback(void *ctxt)
-{
-	struct _dispatch_after_time_s *datc = (struct _dispatch_after_time_s *)ctxt;
-
-	dispatch_assert(datc->datc_func);
-	_dispatch_client_callout(datc->datc_ctxt, datc->datc_func);
-
-	dispatch_source_t ds = datc->ds;
-	free(datc);
-
-	dispatch_source_cancel(ds); // Needed until 7287561 gets integrated
-	dispatch_release(ds);
-}
-
 DISPATCH_NOINLINE
 void
 dispatch_after_f(dispatch_time_t when, dispatch_queue_t queue, void *ctxt,
 		dispatch_function_t func)
 {
 	uint64_t delta;
-	struct _dispatch_after_time_s *datc = NULL;
-	dispatch_source_t ds;
 
 	if (when == DISPATCH_TIME_FOREVER) {
 #if DISPATCH_DEBUG
@@ -1926,46 +3245,312 @@ dispatch_after_f(dispatch_time_t when, dispatch_queue_t queue, void *ctxt,
 #endif
 		return;
 	}
-
-	// this function can and should be optimized to not use a dispatch source
-	delta = _dispatch_timeout(when);
-	if (delta == 0) {
-		return dispatch_async_f(queue, ctxt, func);
+
+	delta = _dispatch_timeout(when);
+	if (delta == 0) {
+		return dispatch_async_f(queue, ctxt, func);
+	}
+	_dispatch_timer_after(when, queue, ctxt, func);
+}
+
+#ifdef __BLOCKS__
+void
+dispatch_after(dispatch_time_t when, dispatch_queue_t queue,
+		dispatch_block_t work)
+{
+	// test before the copy of the block
+	if (when == DISPATCH_TIME_FOREVER) {
+#if DISPATCH_DEBUG
+		DISPATCH_CLIENT_CRASH(
+				"dispatch_after() called with 'when' == infinity");
+#endif
+		return;
+	}
+	dispatch_after_f(when, queue, _dispatch_Block_copy(work),
+			_dispatch_call_block_and_release);
+}
+#endif
+
+#pragma mark -
+#pragma mark dispatch_thread_mediator
+
+#if DISPATCH_ENABLE_THREAD_POOL
+// Wakes up an idle pool thread, returns false if there was none. Unless
+// idle_only is set, a wakeup that finds no idle thread is remembered and
+// consumed by the next thread about to go idle.
+static bool
+_dispatch_thread_mediator_signal(dispatch_thread_mediator_t dtm,
+		bool idle_only)
+{
+#if DISPATCH_USE_FUTEX
+	struct dispatch_thread_idle_s *dti;
+
+	_dispatch_futex_lock(&dtm->dtm_lock);
+	dti = dtm->dtm_head;
+	if (dti) {
+		dtm->dtm_head = dti->dti_next;
+		dti->dti_futex = 1;
+	} else if (!idle_only) {
+		dtm->dtm_pending++;
+	}
+	_dispatch_futex_unlock(&dtm->dtm_lock);
+	if (!dti) {
+		return false;
+	}
+	// The woken thread may already be running again, the wake below only
+	// ever touches the address.
+	(void)_dispatch_futex_wake(&dti->dti_futex, 1);
+	return true;
+#else
+	if (idle_only && dtm->dsema_value >= 0) {
+		return false;
+	}
+	return dispatch_semaphore_signal(dtm);
+#endif
+}
+
+// Parks the calling pool thread until it is signaled, returns false if that
+// did not happen within timeout nanoseconds.
+static bool
+_dispatch_thread_mediator_wait(dispatch_thread_mediator_t dtm,
+		uint64_t timeout)
+{
+	dispatch_time_t when = dispatch_time(0, (int64_t)timeout);
+#if DISPATCH_USE_FUTEX
+	struct dispatch_thread_idle_s dti = { .dti_futex = 0 }, **dtip;
+	struct timespec ts;
+	uint64_t delta;
+
+	_dispatch_futex_lock(&dtm->dtm_lock);
+	if (dtm->dtm_pending) {
+		dtm->dtm_pending--;
+		_dispatch_futex_unlock(&dtm->dtm_lock);
+		return true;
+	}
+	dti.dti_next = dtm->dtm_head;
+	dtm->dtm_head = &dti;
+	_dispatch_futex_unlock(&dtm->dtm_lock);
+
+	while (!dti.dti_futex) {
+		delta = _dispatch_timeout(when);
+		if (!delta) {
+			_dispatch_futex_lock(&dtm->dtm_lock);
+			if (!dti.dti_futex) {
+				// Timed out while still on the idle stack, the coldest
+				// threads are at the bottom so this walk is usually long
+				// but rare.
+				for (dtip = &dtm->dtm_head; *dtip != &dti;
+						dtip = &(*dtip)->dti_next);
+				*dtip = dti.dti_next;
+				_dispatch_futex_unlock(&dtm->dtm_lock);
+				return false;
+			}
+			_dispatch_futex_unlock(&dtm->dtm_lock);
+			break;
+		}
+		ts.tv_sec = (time_t)(delta / NSEC_PER_SEC);
+		ts.tv_nsec = (long)(delta % NSEC_PER_SEC);
+		(void)_dispatch_futex_wait(&dti.dti_futex, 0, &ts);
+	}
+	return true;
+#else
+	return dispatch_semaphore_wait(dtm, when) == 0;
+#endif
+}
+#endif // DISPATCH_ENABLE_THREAD_POOL
+
+#pragma mark -
+#pragma mark dispatch_thread_pool_config
+
+enum {
+	DISPATCH_POOLCNTL_IDLE_TIMEOUT = 1,
+	DISPATCH_POOLCNTL_MAX_THREADS,
+	DISPATCH_POOLCNTL_MIN_THREADS,
+};
+
+// we use 65 seconds in case there are any timers that run once a minute
+#ifndef DISPATCH_THREAD_POOL_IDLE_TIMEOUT
+#define DISPATCH_THREAD_POOL_IDLE_TIMEOUT (65ull * NSEC_PER_SEC)
+#endif
+
+#if DISPATCH_ENABLE_THREAD_POOL
+static uint64_t _dispatch_thread_pool_idle_timeout =
+		DISPATCH_THREAD_POOL_IDLE_TIMEOUT;
+
+// Reserves a thread slot and starts a pool thread for the root queue, returns
+// false if the pool is already at its limit.
+static bool
+_dispatch_thread_pool_spawn(dispatch_queue_t dq)
+{
+	struct dispatch_root_queue_context_s *qc = dq->do_ctxt;
+	pthread_t pthr;
+	uint32_t t_count;
+	int r;
+
+	do {
+		t_count = qc->dgq_thread_pool_size;
+		// may be "negative" after the maximum has been lowered
+		if ((int32_t)t_count <= 0) {
+			_dispatch_debug("The thread pool is full: %p", dq);
+			return false;
+		}
+	} while (!dispatch_atomic_cmpxchg2o(qc, dgq_thread_pool_size, t_count,
+			t_count - 1));
+
+	while ((r = pthread_create(&pthr, NULL, _dispatch_worker_thread, dq))) {
+		if (r != EAGAIN) {
+			(void)dispatch_assume_zero(r);
+		}
+		sleep(1);
+	}
+	r = pthread_detach(pthr);
+	(void)dispatch_assume_zero(r);
+	return true;
+}
+
+// Called by a pool thread that has been idle for the idle timeout, returns
+// true if the thread gave up its slot and should exit, false if it has to stay
+// to keep the minimum number of warm threads.
+static bool
+_dispatch_thread_pool_retire(struct dispatch_root_queue_context_s *qc)
+{
+	uint32_t t_count;
+
+	do {
+		t_count = qc->dgq_thread_pool_size;
+		if ((int32_t)(qc->dgq_thread_pool_max - t_count) <=
+				(int32_t)qc->dgq_thread_pool_min) {
+			return false;
+		}
+	} while (!dispatch_atomic_cmpxchg2o(qc, dgq_thread_pool_size, t_count,
+			t_count + 1));
+	return true;
+}
+
+static void
+_dispatch_thread_pool_set_max(dispatch_queue_t dq, uint32_t max)
+{
+	struct dispatch_root_queue_context_s *qc = dq->do_ctxt;
+	uint32_t old_max;
+
+	if (max < 1) {
+		max = 1;
+	} else if (max > INT32_MAX) {
+		max = INT32_MAX;
+	}
+	old_max = dispatch_atomic_xchg2o(qc, dgq_thread_pool_max, max);
+	// running threads above a lowered maximum exit once they go idle
+	(void)dispatch_atomic_add2o(qc, dgq_thread_pool_size, max - old_max);
+	if (qc->dgq_thread_pool_min > max) {
+		qc->dgq_thread_pool_min = max;
+	}
+}
+
+static void
+_dispatch_thread_pool_set_min(dispatch_queue_t dq, uint32_t min)
+{
+	struct dispatch_root_queue_context_s *qc = dq->do_ctxt;
+
+#if HAVE_PTHREAD_WORKQUEUES
+	if (qc->dgq_kworkqueue != (void*)(~0ul)) {
+		return; // not using the thread pool
+	}
+#endif
+	if (min > qc->dgq_thread_pool_max) {
+		min = qc->dgq_thread_pool_max;
+	}
+	qc->dgq_thread_pool_min = min;
+	while ((int32_t)(qc->dgq_thread_pool_max - qc->dgq_thread_pool_size) <
+			(int32_t)min && _dispatch_thread_pool_spawn(dq));
+}
+
+static unsigned long
+_dispatch_thread_pool_getenv(const char *name, unsigned long dflt)
+{
+	const char *value = getenv(name);
+
+	if (slowpath(value)) {
+		return strtoul(value, NULL, 0);
+	}
+	return dflt;
+}
+
+// Environment overrides, applied from libdispatch_init():
+//   LIBDISPATCH_POOL_IDLE_TIMEOUT_MS	idle time before a pool thread exits
+//   LIBDISPATCH_POOL_MAX_THREADS		thread limit of every root queue
+//   LIBDISPATCH_POOL_MIN_THREADS		warm threads pre-spawned for the
+//										default priority root queue
+static void
+_dispatch_thread_pool_config_init(void)
+{
+	unsigned long value;
+	int i;
+
+	value = _dispatch_thread_pool_getenv("LIBDISPATCH_POOL_IDLE_TIMEOUT_MS",
+			0);
+	if (value) {
+		_dispatch_thread_pool_idle_timeout = value * NSEC_PER_MSEC;
+	}
+	value = _dispatch_thread_pool_getenv("LIBDISPATCH_POOL_MAX_THREADS", 0);
+	if (value) {
+		for (i = 0; i < DISPATCH_ROOT_QUEUE_COUNT; i++) {
+			_dispatch_thread_pool_set_max(&_dispatch_root_queues[i],
+					(uint32_t)value);
+		}
+	}
+	value = _dispatch_thread_pool_getenv("LIBDISPATCH_POOL_MIN_THREADS", 0);
+	if (value) {
+		_dispatch_poolcntl(&_dispatch_root_queues[
+				DISPATCH_ROOT_QUEUE_IDX_DEFAULT_PRIORITY],
+				DISPATCH_POOLCNTL_MIN_THREADS, value);
 	}
-	// on successful creation, source owns malloc-ed context (which it frees in
-	// the event handler)
-	ds = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
-	dispatch_assert(ds);
-
-	datc = (struct _dispatch_after_time_s *)malloc(sizeof(*datc));
-	dispatch_assert(datc);
-	datc->datc_ctxt = ctxt;
-	datc->datc_func = func;
-	datc->ds = ds;
-
-	dispatch_set_context(ds, datc);
-	dispatch_source_set_event_handler_f(ds, _dispatch_after_timer_callback);
-	dispatch_source_set_timer(ds, when, DISPATCH_TIME_FOREVER, 0);
-	dispatch_resume(ds);
 }
+#else
+static void
+_dispatch_thread_pool_config_init(void)
+{
+}
+#endif // DISPATCH_ENABLE_THREAD_POOL
 
-#ifdef __BLOCKS__
+// Configures the thread pool of the root queue dq, or of all root queues if
+// dq is NULL. The idle timeout (in nanoseconds) is shared by all root queues.
+// Has no effect when root queues are serviced by kernel workqueues.
 void
-dispatch_after(dispatch_time_t when, dispatch_queue_t queue,
-		dispatch_block_t work)
+_dispatch_poolcntl(dispatch_queue_t dq, uint32_t param, uint64_t value)
 {
-	// test before the copy of the block
-	if (when == DISPATCH_TIME_FOREVER) {
-#if DISPATCH_DEBUG
-		DISPATCH_CLIENT_CRASH(
-				"dispatch_after() called with 'when' == infinity");
-#endif
+#if DISPATCH_ENABLE_THREAD_POOL
+	int i;
+
+	if (!dq) {
+		for (i = 0; i < DISPATCH_ROOT_QUEUE_COUNT; i++) {
+			_dispatch_poolcntl(&_dispatch_root_queues[i], param, value);
+		}
 		return;
 	}
-	dispatch_after_f(when, queue, _dispatch_Block_copy(work),
-			_dispatch_call_block_and_release);
-}
+	if (slowpath(dq < _dispatch_root_queues ||
+			dq >= _dispatch_root_queues + DISPATCH_ROOT_QUEUE_COUNT)) {
+		DISPATCH_CLIENT_CRASH("_dispatch_poolcntl called on a non-root queue");
+	}
+	if (value > UINT32_MAX && param != DISPATCH_POOLCNTL_IDLE_TIMEOUT) {
+		value = UINT32_MAX;
+	}
+	switch (param) {
+	case DISPATCH_POOLCNTL_IDLE_TIMEOUT:
+		_dispatch_thread_pool_idle_timeout = value;
+		break;
+	case DISPATCH_POOLCNTL_MAX_THREADS:
+		_dispatch_thread_pool_set_max(dq, (uint32_t)value);
+		break;
+	case DISPATCH_POOLCNTL_MIN_THREADS:
+		dispatch_once_f(&_dispatch_root_queues_pred, NULL,
+				_dispatch_root_queues_init);
+		_dispatch_thread_pool_set_min(dq, (uint32_t)value);
+		break;
+	}
+#else
+	(void)dq; (void)param; (void)value;
 #endif
+}
 
 #pragma mark -
 #pragma mark dispatch_wakeup
@@ -2088,13 +3673,15 @@ DISPATCH_NOINLINE
 static void
 _dispatch_queue_wakeup_global_slow(dispatch_queue_t dq, unsigned int n)
 {
-	static dispatch_once_t pred;
 	struct dispatch_root_queue_context_s *qc =
 			(struct dispatch_root_queue_context_s *)dq->do_ctxt;
+#if HAVE_PTHREAD_WORKQUEUES
 	int r;
+#endif
 
 	dispatch_debug_queue(dq, __func__);
-	dispatch_once_f(&pred, NULL, _dispatch_root_queues_init);
+	dispatch_once_f(&_dispatch_root_queues_pred, NULL,
+			_dispatch_root_queues_init);
 
 #if HAVE_PTHREAD_WORKQUEUES
 #if DISPATCH_ENABLE_THREAD_POOL
@@ -2123,41 +3710,21 @@ _dispatch_queue_wakeup_global_slow(dispatch_queue_t dq, unsigned int n)
 	}
 #endif // HAVE_PTHREAD_WORKQUEUES
 #if DISPATCH_ENABLE_THREAD_POOL
-	if (dispatch_semaphore_signal(qc->dgq_thread_mediator)) {
-		return;
-	}
-
-	pthread_t pthr;
-	int t_count;
 	do {
-		t_count = qc->dgq_thread_pool_size;
-		if (!t_count) {
-			_dispatch_debug("The thread pool is full: %p", dq);
-			return;
-		}
-	} while (!dispatch_atomic_cmpxchg2o(qc, dgq_thread_pool_size, t_count,
-			t_count - 1));
-
-	while ((r = pthread_create(&pthr, NULL, _dispatch_worker_thread, dq))) {
-		if (r != EAGAIN) {
-			(void)dispatch_assume_zero(r);
+		if (!_dispatch_thread_mediator_signal(qc->dgq_thread_mediator,
+				false) && !_dispatch_thread_pool_spawn(dq)) {
+			break;
 		}
-		sleep(1);
-	}
-	r = pthread_detach(pthr);
-	(void)dispatch_assume_zero(r);
+	} while (--n);
 #endif // DISPATCH_ENABLE_THREAD_POOL
 }
 
 static inline void
-_dispatch_queue_wakeup_global2(dispatch_queue_t dq, unsigned int n)
+_dispatch_queue_wakeup_global3(dispatch_queue_t dq, unsigned int n)
 {
 	struct dispatch_root_queue_context_s *qc =
 			(struct dispatch_root_queue_context_s *)dq->do_ctxt;
 
-	if (!dq->dq_items_tail) {
-		return;
-	}
 #if HAVE_PTHREAD_WORKQUEUES
 	if (
 #if DISPATCH_ENABLE_THREAD_POOL
@@ -2172,6 +3739,15 @@ _dispatch_queue_wakeup_global2(dispatch_queue_t dq, unsigned int n)
 	return 	_dispatch_queue_wakeup_global_slow(dq, n);
 }
 
+static inline void
+_dispatch_queue_wakeup_global2(dispatch_queue_t dq, unsigned int n)
+{
+	if (!dq->dq_items_tail) {
+		return;
+	}
+	return _dispatch_queue_wakeup_global3(dq, n);
+}
+
 static inline void
 _dispatch_queue_wakeup_global(dispatch_queue_t dq)
 {
@@ -2198,13 +3774,17 @@ _dispatch_queue_invoke(dispatch_queue_t dq)
 			fastpath(dispatch_atomic_cmpxchg2o(dq, dq_running, 0, 1))) {
 		dispatch_atomic_acquire_barrier();
 		dispatch_queue_t otq = dq->do_targetq, tq = NULL;
-		_dispatch_thread_semaphore_t sema = _dispatch_queue_drain(dq);
+		bool yielded = false;
+		_dispatch_thread_semaphore_t sema = _dispatch_queue_drain(dq, &yielded);
 		if (dq->do_vtable->do_invoke) {
 			// Assume that object invoke checks it is executing on correct queue
 			tq = dx_invoke(dq);
 		} else if (slowpath(otq != dq->do_targetq)) {
 			// An item on the queue changed the target queue
 			tq = dq->do_targetq;
+		} else if (slowpath(yielded)) {
+			// The drain quantum expired, go to the back of the target queue
+			tq = otq;
 		}
 		// We do not need to check the result.
 		// When the suspend-count lock is dropped, then the check will happen.
@@ -2229,12 +3809,31 @@ _dispatch_queue_invoke(dispatch_queue_t dq)
 }
 
 static _dispatch_thread_semaphore_t
-_dispatch_queue_drain(dispatch_queue_t dq)
+_dispatch_queue_drain(dispatch_queue_t dq, bool *yielded)
 {
 	dispatch_queue_t orig_tq, old_dq;
 	old_dq = (dispatch_queue_t)_dispatch_thread_getspecific(dispatch_queue_key);
 	struct dispatch_object_s *dc = NULL, *next_dc = NULL;
 	_dispatch_thread_semaphore_t sema = 0;
+	uint32_t items = 0, max_items = 0;
+	uint64_t deadline = 0;
+	int64_t budget = 0, credit = 0;
+
+	if (yielded) {
+		max_items = dq->dq_drain_items;
+		budget = (int64_t)dq->dq_drain_time;
+		if (slowpath(dq->dq_weight)) {
+			if (!budget) {
+				budget = (int64_t)_dispatch_time_nano2mach(
+						DISPATCH_QUEUE_WEIGHT_QUANTUM);
+			}
+			credit = budget * dq->dq_weight;
+			budget = dq->dq_drain_deficit + credit;
+		}
+		if (budget || dq->dq_weight) {
+			deadline = _dispatch_absolute_time() + (uint64_t)budget;
+		}
+	}
 
 	// Continue draining sources after target queue change rdar://8928171
 	bool check_tq = (dx_type(dq) != DISPATCH_SOURCE_KEVENT_TYPE);
@@ -2278,12 +3877,33 @@ _dispatch_queue_drain(dispatch_queue_t dq)
 					continue;
 				}
 			}
+			if (slowpath(max_items && items >= max_items) ||
+					slowpath(deadline && (items || budget <= 0) &&
+					(int64_t)(_dispatch_absolute_time() - deadline) >= 0)) {
+				// Drain quantum expired, yield to the other queues
+				*yielded = true;
+				goto out;
+			}
 			if ((sema = _dispatch_barrier_sync_f_pop(dq, dc, true))) {
 				dc = next_dc;
 				goto out;
 			}
-			_dispatch_continuation_pop(dc);
+			if (slowpath(dq->dq_capacity) && !DISPATCH_OBJ_IS_VTABLE(dc) &&
+					((long)dc->do_vtable & DISPATCH_OBJ_BOUNDED_BIT) &&
+					_dispatch_queue_capacity_pop(dq->dq_capacity)) {
+				if (slowpath(dq->dq_stats)) {
+					_dispatch_queue_stats_drop(dq, dc);
+				}
+				_dispatch_continuation_drop((dispatch_continuation_t)dc);
+				continue;
+			}
+			if (slowpath(dq->dq_stats)) {
+				_dispatch_queue_stats_pop(dq, dc);
+			} else {
+				_dispatch_continuation_pop(dc);
+			}
 			_dispatch_workitem_inc();
+			items++;
 		} while ((dc = next_dc));
 	}
 
@@ -2302,6 +3922,17 @@ out:
 		}
 		dq->dq_items_head = dc;
 	}
+	if (slowpath(yielded && dq->dq_weight)) {
+		// Carry an overrun over to the next turn of a queue with items left,
+		// but only while other queues wait on the target: alone, the queue
+		// would just cycle through it. It sits out at most one turn.
+		budget = 0;
+		if (dc && dq->do_targetq->dq_items_tail) {
+			budget = (int64_t)(deadline - _dispatch_absolute_time());
+		}
+		dq->dq_drain_deficit = budget < -credit ? -credit :
+				(budget < 0 ? budget : 0);
+	}
 
 	_dispatch_thread_setspecific(dispatch_queue_key, old_dq);
 	return sema;
@@ -2313,7 +3944,7 @@ _dispatch_queue_serial_drain_till_empty(dispatch_queue_t dq)
 #if DISPATCH_PERF_MON
 	uint64_t start = _dispatch_absolute_time();
 #endif
-	_dispatch_thread_semaphore_t sema = _dispatch_queue_drain(dq);
+	_dispatch_thread_semaphore_t sema = _dispatch_queue_drain(dq, NULL);
 	if (sema) {
 		dispatch_atomic_barrier();
 		_dispatch_thread_semaphore_signal(sema);
@@ -2392,91 +4023,427 @@ _dispatch_queue_drain_one_barrier_sync(dispatch_queue_t dq)
 	struct dispatch_object_s *dc, *next_dc;
 	_dispatch_thread_semaphore_t sema;
 
-	// queue is locked, or suspended and not being drained
-	dc = dq->dq_items_head;
-	if (slowpath(!dc) || !(sema = _dispatch_barrier_sync_f_pop(dq, dc, false))){
-		return 0;
+	// queue is locked, or suspended and not being drained
+	dc = dq->dq_items_head;
+	if (slowpath(!dc) || !(sema = _dispatch_barrier_sync_f_pop(dq, dc, false))){
+		return 0;
+	}
+	// dequeue dc, it is a barrier sync
+	next_dc = fastpath(dc->do_next);
+	dq->dq_items_head = next_dc;
+	if (!next_dc && !dispatch_atomic_cmpxchg2o(dq, dq_items_tail, dc, NULL)) {
+		// Enqueue is TIGHTLY controlled, we won't wait long.
+		while (!(next_dc = fastpath(dc->do_next))) {
+			_dispatch_hardware_pause();
+		}
+		dq->dq_items_head = next_dc;
+	}
+	return sema;
+}
+
+#pragma mark -
+#pragma mark dispatch_queue_contention
+
+// Threads that lose the race for the head of a root queue spin with
+// exponential backoff for up to a per root queue budget. The budget tracks
+// twice the observed hold time when the head is released while spinning and
+// is halved when it is not, so that spinning stops quickly when the holder is
+// descheduled or the items are expensive to dequeue.
+
+#ifndef DISPATCH_HEAD_CONTENTION_SPINS
+#define DISPATCH_HEAD_CONTENTION_SPINS 10000
+#endif
+#ifndef DISPATCH_HEAD_CONTENTION_SPINS_MIN
+#define DISPATCH_HEAD_CONTENTION_SPINS_MIN 64
+#endif
+#ifndef DISPATCH_HEAD_CONTENTION_BACKOFF_MAX
+#define DISPATCH_HEAD_CONTENTION_BACKOFF_MAX 128
+#endif
+
+// Per-thread counters, merged into the totals when a worker stops draining
+static __thread struct dispatch_contention_s {
+	unsigned long dcn_events;
+	unsigned long dcn_spins;
+	unsigned long dcn_timeouts;
+} _dispatch_contention;
+
+static struct {
+	uint64_t volatile events;
+	uint64_t volatile spins;
+	uint64_t volatile timeouts;
+} _dispatch_contention_totals;
+
+DISPATCH_EXPORT DISPATCH_NOTHROW
+void _dispatch_queue_contention_stats(uint64_t *events, uint64_t *spins,
+		uint64_t *timeouts);
+
+static bool
+_dispatch_queue_contention_spin(dispatch_queue_t dq,
+		struct dispatch_object_s *mediator)
+{
+	struct dispatch_root_queue_context_s *qc =
+			(struct dispatch_root_queue_context_s *)dq->do_ctxt;
+	unsigned int limit = qc->dgq_spin_limit, spins = 0, pause = 1, i;
+	bool acquired = false;
+
+	if (!limit) {
+		limit = DISPATCH_HEAD_CONTENTION_SPINS;
+	}
+	_dispatch_contention.dcn_events++;
+	while (spins < limit) {
+		for (i = pause; i; i--) {
+			_dispatch_hardware_pause();
+		}
+		spins += pause;
+		if (dq->dq_items_head != mediator) {
+			acquired = true;
+			break;
+		}
+		if (pause < DISPATCH_HEAD_CONTENTION_BACKOFF_MAX) {
+			pause <<= 1;
+		}
+	}
+	_dispatch_contention.dcn_spins += spins;
+	if (acquired) {
+		// Move the ceiling 1/8th of the way towards twice the hold time
+		limit = limit - limit / 8 + spins / 4;
+	} else {
+		_dispatch_contention.dcn_timeouts++;
+		limit /= 2;
+	}
+	if (limit < DISPATCH_HEAD_CONTENTION_SPINS_MIN) {
+		limit = DISPATCH_HEAD_CONTENTION_SPINS_MIN;
+	} else if (limit > DISPATCH_HEAD_CONTENTION_SPINS) {
+		limit = DISPATCH_HEAD_CONTENTION_SPINS;
+	}
+	qc->dgq_spin_limit = limit;
+	return acquired;
+}
+
+static void
+_dispatch_queue_contention_merge(void)
+{
+	struct dispatch_contention_s *dcn = &_dispatch_contention;
+
+	if (fastpath(!dcn->dcn_events)) {
+		return;
+	}
+	(void)dispatch_atomic_add(&_dispatch_contention_totals.events,
+			dcn->dcn_events);
+	(void)dispatch_atomic_add(&_dispatch_contention_totals.spins,
+			dcn->dcn_spins);
+	(void)dispatch_atomic_add(&_dispatch_contention_totals.timeouts,
+			dcn->dcn_timeouts);
+	dcn->dcn_events = dcn->dcn_spins = dcn->dcn_timeouts = 0;
+}
+
+// Totals only include counts from workers that have since stopped draining
+void
+_dispatch_queue_contention_stats(uint64_t *events, uint64_t *spins,
+		uint64_t *timeouts)
+{
+	if (events) {
+		*events = _dispatch_contention_totals.events;
+	}
+	if (spins) {
+		*spins = _dispatch_contention_totals.spins;
+	}
+	if (timeouts) {
+		*timeouts = _dispatch_contention_totals.timeouts;
+	}
+}
+
+static struct dispatch_object_s *
+_dispatch_queue_concurrent_drain_one(dispatch_queue_t dq)
+{
+	struct dispatch_object_s *head, *next, *const mediator = 
+			(struct dispatch_object_s *)~0ul;
+
+start:
+	// The mediator value acts both as a "lock" and a signal
+	head = dispatch_atomic_xchg2o(dq, dq_items_head, mediator);
+
+	if (slowpath(head == NULL)) {
+		// The first xchg on the tail will tell the enqueueing thread that it
+		// is safe to blindly write out to the head pointer. A cmpxchg honors
+		// the algorithm.
+		(void)dispatch_atomic_cmpxchg2o(dq, dq_items_head, mediator, NULL);
+		_dispatch_debug("no work on global work queue");
+		return NULL;
+	}
+
+	if (slowpath(head == mediator)) {
+		// This thread lost the race for ownership of the queue.
+		// Spin for a short while in case many threads have started draining at
+		// once as part of a dispatch_apply
+		if (_dispatch_queue_contention_spin(dq, mediator)) {
+			goto start;
+		}
+		// The ratio of work to libdispatch overhead must be bad. This
+		// scenario implies that there are too many threads draining.
+		// Exit this thread without requesting a new one, the owner of the
+		// head wakes up another thread when it restores a non-empty list.
+		_dispatch_debug("Contention on queue: %p", dq);
+#if DISPATCH_PERF_MON
+		dispatch_atomic_inc(&_dispatch_bad_ratio);
+#endif
+		return NULL;
+	}
+
+	// Restore the head pointer to a sane value before returning.
+	// If 'next' is NULL, then this item _might_ be the last item.
+	next = fastpath(head->do_next);
+
+	if (slowpath(!next)) {
+		dq->dq_items_head = NULL;
+
+		if (dispatch_atomic_cmpxchg2o(dq, dq_items_tail, head, NULL)) {
+			// both head and tail are NULL now
+			goto out;
+		}
+
+		// There must be a next item now. This thread won't wait long.
+		while (!(next = head->do_next)) {
+			_dispatch_hardware_pause();
+		}
+	}
+
+	dq->dq_items_head = next;
+	_dispatch_queue_wakeup_global(dq);
+out:
+	return head;
+}
+
+#pragma mark -
+#pragma mark dispatch_worker_deque
+
+#if DISPATCH_USE_WORK_STEALING
+// Each worker thread draining a root queue owns a bounded Chase-Lev deque.
+// Items async'd to that root queue from the worker are pushed onto the
+// bottom of its deque and popped back LIFO by the owner, idle workers steal
+// from the top. The shared root queue list only receives items submitted
+// from outside the pool or overflowing a full deque.
+
+struct dispatch_worker_deque_s {
+	long volatile dwd_top DISPATCH_CACHELINE_ALIGN;
+	long volatile dwd_bottom DISPATCH_CACHELINE_ALIGN;
+	dispatch_queue_t dwd_queue;
+	unsigned int volatile dwd_owned;
+	unsigned int dwd_ticks;
+	struct dispatch_object_s *volatile dwd_items[DISPATCH_WORKER_DEQUE_SIZE];
+};
+
+typedef struct dispatch_worker_deque_s *dispatch_worker_deque_t;
+
+// Deques are never freed, so thieves may probe them without any lifetime
+// coordination with the owning threads
+DISPATCH_NOINLINE
+static dispatch_worker_deque_t
+_dispatch_worker_deques_init(dispatch_queue_t dq)
+{
+	struct dispatch_root_queue_context_s *qc = dq->do_ctxt;
+	size_t size = sizeof(struct dispatch_worker_deque_s) *
+			DISPATCH_WORKER_DEQUE_COUNT;
+	dispatch_worker_deque_t dwds;
+	void *buf;
+	unsigned int i;
+
+	while (slowpath(posix_memalign(&buf, DISPATCH_CACHELINE_SIZE, size))) {
+		sleep(1);
+	}
+	memset(buf, 0, size);
+	dwds = buf;
+	for (i = 0; i < DISPATCH_WORKER_DEQUE_COUNT; i++) {
+		dwds[i].dwd_queue = dq;
+	}
+	if (!dispatch_atomic_cmpxchg2o(qc, dgq_deques, NULL, dwds)) {
+		free(dwds);
+		dwds = qc->dgq_deques;
+	}
+	return dwds;
+}
+
+static dispatch_worker_deque_t
+_dispatch_worker_deque_claim(dispatch_queue_t dq)
+{
+	struct dispatch_root_queue_context_s *qc = dq->do_ctxt;
+	dispatch_worker_deque_t dwd, dwds = fastpath(qc->dgq_deques);
+	unsigned int i, width;
+
+	if (slowpath(!dwds)) {
+		dwds = _dispatch_worker_deques_init(dq);
+	}
+	for (i = 0; i < DISPATCH_WORKER_DEQUE_COUNT; i++) {
+		dwd = &dwds[i];
+		if (dwd->dwd_owned ||
+				!dispatch_atomic_cmpxchg2o(dwd, dwd_owned, 0, 1)) {
+			continue;
+		}
+		// publish the slot to thieves
+		do {
+			width = qc->dgq_deque_width;
+			if (i < width) {
+				break;
+			}
+		} while (!dispatch_atomic_cmpxchg2o(qc, dgq_deque_width, width,
+				i + 1));
+		return dwd;
+	}
+	// more workers than deques, this worker only drains and steals
+	return NULL;
+}
+
+static void
+_dispatch_worker_deque_release(dispatch_worker_deque_t dwd)
+{
+	dispatch_assert(dwd->dwd_bottom == dwd->dwd_top);
+	dispatch_atomic_release_barrier();
+	dwd->dwd_owned = 0;
+}
+
+DISPATCH_ALWAYS_INLINE
+static inline void
+_dispatch_worker_deque_wakeup(dispatch_queue_t dq, long depth)
+{
+#if DISPATCH_ENABLE_THREAD_POOL
+	struct dispatch_root_queue_context_s *qc = dq->do_ctxt;
+
+#if HAVE_PTHREAD_WORKQUEUES
+	if (qc->dgq_kworkqueue == (void*)(~0ul))
+#endif
+	if (depth == 1) {
+		// The owner will most likely pop this item itself, so prefer waking a
+		// worker that is already idle in case the owner is about to block.
+		// Without one, the owner may block waiting for this very item.
+		if (_dispatch_thread_mediator_signal(qc->dgq_thread_mediator, true)) {
+			return;
+		}
+	}
+#endif
+	// Surplus work in the deque, request a thief like
+	// _dispatch_queue_concurrent_drain_one() does for the shared list
+	_dispatch_queue_wakeup_global3(dq, 1);
+}
+
+DISPATCH_ALWAYS_INLINE
+static inline bool
+_dispatch_worker_deque_push(dispatch_queue_t dq, dispatch_object_t dou)
+{
+	dispatch_worker_deque_t dwd = (dispatch_worker_deque_t)
+			_dispatch_thread_getspecific(dispatch_deque_key);
+	long b, t;
+
+	if (!dwd || dwd->dwd_queue != dq) {
+		return false;
+	}
+	if (slowpath(_dispatch_hw_config.cc_max_active < 2)) {
+		// nobody to steal from the deque, use the shared root queue list
+		return false;
+	}
+	b = dwd->dwd_bottom;
+	t = dwd->dwd_top;
+	if (slowpath(b - t >= DISPATCH_WORKER_DEQUE_SIZE)) {
+		// overflow into the shared root queue list
+		return false;
+	}
+	_dispatch_trace_continuation_push(dq, dou);
+	dwd->dwd_items[b & (DISPATCH_WORKER_DEQUE_SIZE - 1)] = dou._do;
+	dispatch_atomic_store_barrier();
+	dwd->dwd_bottom = b + 1;
+	if (b - t < 2) {
+		_dispatch_worker_deque_wakeup(dq, b - t + 1);
+	}
+	return true;
+}
+
+DISPATCH_ALWAYS_INLINE
+static inline struct dispatch_object_s *
+_dispatch_worker_deque_pop(dispatch_worker_deque_t dwd)
+{
+	struct dispatch_object_s *item;
+	long b, t;
+
+	b = dwd->dwd_bottom - 1;
+	// full barrier: the store to dwd_bottom must be visible to thieves
+	// before dwd_top is read
+	(void)dispatch_atomic_xchg2o(dwd, dwd_bottom, b);
+	t = dwd->dwd_top;
+	if (slowpath(t > b)) {
+		dwd->dwd_bottom = b + 1;
+		return NULL;
 	}
-	// dequeue dc, it is a barrier sync
-	next_dc = fastpath(dc->do_next);
-	dq->dq_items_head = next_dc;
-	if (!next_dc && !dispatch_atomic_cmpxchg2o(dq, dq_items_tail, dc, NULL)) {
-		// Enqueue is TIGHTLY controlled, we won't wait long.
-		while (!(next_dc = fastpath(dc->do_next))) {
-			_dispatch_hardware_pause();
+	item = dwd->dwd_items[b & (DISPATCH_WORKER_DEQUE_SIZE - 1)];
+	if (t == b) {
+		// last item, race the thieves for it
+		if (!dispatch_atomic_cmpxchg2o(dwd, dwd_top, t, t + 1)) {
+			item = NULL;
 		}
-		dq->dq_items_head = next_dc;
+		dwd->dwd_bottom = b + 1;
 	}
-	return sema;
+	return item;
 }
 
-#ifndef DISPATCH_HEAD_CONTENTION_SPINS
-#define DISPATCH_HEAD_CONTENTION_SPINS 10000
-#endif
-
 static struct dispatch_object_s *
-_dispatch_queue_concurrent_drain_one(dispatch_queue_t dq)
+_dispatch_worker_deque_steal(dispatch_queue_t dq, dispatch_worker_deque_t self)
 {
-	struct dispatch_object_s *head, *next, *const mediator = 
-			(struct dispatch_object_s *)~0ul;
-
-start:
-	// The mediator value acts both as a "lock" and a signal
-	head = dispatch_atomic_xchg2o(dq, dq_items_head, mediator);
+	struct dispatch_root_queue_context_s *qc = dq->do_ctxt;
+	dispatch_worker_deque_t dwd, dwds = qc->dgq_deques;
+	struct dispatch_object_s *item;
+	unsigned int i, n, width = qc->dgq_deque_width;
+	long b, t;
 
-	if (slowpath(head == NULL)) {
-		// The first xchg on the tail will tell the enqueueing thread that it
-		// is safe to blindly write out to the head pointer. A cmpxchg honors
-		// the algorithm.
-		(void)dispatch_atomic_cmpxchg2o(dq, dq_items_head, mediator, NULL);
-		_dispatch_debug("no work on global work queue");
+	if (!dwds || !width) {
 		return NULL;
 	}
-
-	if (slowpath(head == mediator)) {
-		// This thread lost the race for ownership of the queue.
-		// Spin for a short while in case many threads have started draining at
-		// once as part of a dispatch_apply
-		unsigned int i = DISPATCH_HEAD_CONTENTION_SPINS;
+	// start with the next peer to spread thieves over victims
+	i = self ? (unsigned int)(self - dwds) : 0;
+	for (n = 0; n < width; n++) {
+		dwd = &dwds[++i % width];
+		if (dwd == self) {
+			continue;
+		}
 		do {
-			_dispatch_hardware_pause();
-			if (dq->dq_items_head != mediator) goto start;
-		} while (--i);
-		// The ratio of work to libdispatch overhead must be bad. This
-		// scenario implies that there are too many threads in the pool.
-		// Create a new pending thread and then exit this thread.
-		// The kernel will grant a new thread when the load subsides.
-		_dispatch_debug("Contention on queue: %p", dq);
-		_dispatch_queue_wakeup_global(dq);
-#if DISPATCH_PERF_MON
-		dispatch_atomic_inc(&_dispatch_bad_ratio);
-#endif
-		return NULL;
+			t = dwd->dwd_top;
+			_dispatch_atomic_barrier();
+			b = dwd->dwd_bottom;
+			if (t >= b) {
+				item = NULL;
+				break;
+			}
+			item = dwd->dwd_items[t & (DISPATCH_WORKER_DEQUE_SIZE - 1)];
+			// lost the race with the owner or another thief: retry
+		} while (!dispatch_atomic_cmpxchg2o(dwd, dwd_top, t, t + 1));
+		if (item) {
+			if (b - t > 1) {
+				_dispatch_queue_wakeup_global3(dq, 1);
+			}
+			return item;
+		}
 	}
+	return NULL;
+}
 
-	// Restore the head pointer to a sane value before returning.
-	// If 'next' is NULL, then this item _might_ be the last item.
-	next = fastpath(head->do_next);
-
-	if (slowpath(!next)) {
-		dq->dq_items_head = NULL;
-
-		if (dispatch_atomic_cmpxchg2o(dq, dq_items_tail, head, NULL)) {
-			// both head and tail are NULL now
-			goto out;
-		}
+static struct dispatch_object_s *
+_dispatch_worker_deque_drain_one(dispatch_queue_t dq,
+		dispatch_worker_deque_t dwd)
+{
+	struct dispatch_object_s *item;
 
-		// There must be a next item now. This thread won't wait long.
-		while (!(next = head->do_next)) {
-			_dispatch_hardware_pause();
+	if (fastpath(dwd) &&
+			fastpath(++dwd->dwd_ticks % DISPATCH_WORKER_DEQUE_INJECT_INTERVAL)) {
+		if ((item = _dispatch_worker_deque_pop(dwd))) {
+			return item;
 		}
 	}
-
-	dq->dq_items_head = next;
-	_dispatch_queue_wakeup_global(dq);
-out:
-	return head;
+	if ((item = _dispatch_queue_concurrent_drain_one(dq))) {
+		return item;
+	}
+	if (dwd && (item = _dispatch_worker_deque_pop(dwd))) {
+		return item;
+	}
+	return _dispatch_worker_deque_steal(dq, dwd);
 }
+#endif // DISPATCH_USE_WORK_STEALING
 
 #pragma mark -
 #pragma mark dispatch_worker_thread
@@ -2485,6 +4452,9 @@ static void
 _dispatch_worker_thread4(dispatch_queue_t dq)
 {
 	struct dispatch_object_s *item;
+#if DISPATCH_USE_WORK_STEALING
+	dispatch_worker_deque_t dwd;
+#endif
 
 
 #if DISPATCH_DEBUG
@@ -2506,12 +4476,25 @@ _dispatch_worker_thread4(dispatch_queue_t dq)
 #if DISPATCH_PERF_MON
 	uint64_t start = _dispatch_absolute_time();
 #endif
+#if DISPATCH_USE_WORK_STEALING
+	dwd = _dispatch_worker_deque_claim(dq);
+	_dispatch_thread_setspecific(dispatch_deque_key, dwd);
+	while ((item = fastpath(_dispatch_worker_deque_drain_one(dq, dwd)))) {
+		_dispatch_continuation_pop(item);
+	}
+	_dispatch_thread_setspecific(dispatch_deque_key, NULL);
+	if (dwd) {
+		_dispatch_worker_deque_release(dwd);
+	}
+#else
 	while ((item = fastpath(_dispatch_queue_concurrent_drain_one(dq)))) {
 		_dispatch_continuation_pop(item);
 	}
+#endif
 #if DISPATCH_PERF_MON
 	_dispatch_queue_merge_stats(start);
 #endif
+	_dispatch_queue_contention_merge();
 
 #if DISPATCH_COCOA_COMPAT
 	_dispatch_autorelease_pool_pop(pool);
@@ -2579,11 +4562,10 @@ _dispatch_worker_thread(void *context)
 
 	do {
 		_dispatch_worker_thread4(dq);
-		// we use 65 seconds in case there are any timers that run once a minute
-	} while (dispatch_semaphore_wait(qc->dgq_thread_mediator,
-			dispatch_time(0, 65ull * NSEC_PER_SEC)) == 0);
+	} while (_dispatch_thread_mediator_wait(qc->dgq_thread_mediator,
+			_dispatch_thread_pool_idle_timeout) ||
+			!_dispatch_thread_pool_retire(qc));
 
-	(void)dispatch_atomic_inc2o(qc, dgq_thread_pool_size);
 	if (dq->dq_items_tail) {
 		_dispatch_queue_wakeup_global(dq);
 	}
@@ -2823,6 +4805,76 @@ static void **_dispatch_wfd_ptrs;
 
 static int _dispatch_kq;
 
+#if DISPATCH_USE_EPOLL
+// The manager thread waits on an epoll descriptor. Read and write kevents
+// are translated to epoll registrations, the manager wakeup EVFILT_USER
+// kevent to an eventfd. Any other filter is registered with a kqueue that is
+// only created on demand and nested in the epoll set.
+static int _dispatch_epfd;
+static int _dispatch_eventfd;
+#define _dispatch_mgr_fd _dispatch_epfd
+
+static void _dispatch_epoll_fds_init(void);
+
+static void
+_dispatch_epoll_init(void *context DISPATCH_UNUSED)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = &_dispatch_eventfd,
+	};
+
+	_dispatch_safe_fork = false;
+	_dispatch_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (_dispatch_epfd == -1) {
+		DISPATCH_CLIENT_CRASH("epoll_create1() failed: "
+				"probably out of file descriptors");
+	} else if (dispatch_assume(_dispatch_epfd < FD_SETSIZE)) {
+	// in case we fall back to select()
+		FD_SET(_dispatch_epfd, &_dispatch_rfds);
+	}
+	_dispatch_eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (_dispatch_eventfd == -1) {
+		DISPATCH_CLIENT_CRASH("eventfd() create failed: "
+				"probably out of file descriptors");
+	}
+	(void)dispatch_assume_zero(epoll_ctl(_dispatch_epfd, EPOLL_CTL_ADD,
+			_dispatch_eventfd, &ev));
+	_dispatch_epoll_fds_init();
+
+	_dispatch_queue_push(_dispatch_mgr_q.do_targetq, &_dispatch_mgr_q);
+}
+
+static int
+_dispatch_get_epfd(void)
+{
+	static dispatch_once_t pred;
+
+	dispatch_once_f(&pred, NULL, _dispatch_epoll_init);
+
+	return _dispatch_epfd;
+}
+
+static void
+_dispatch_get_kq_init(void *context DISPATCH_UNUSED)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = &_dispatch_kq,
+	};
+	int epfd = _dispatch_get_epfd();
+
+	_dispatch_kq = kqueue();
+	if (_dispatch_kq == -1) {
+		DISPATCH_CLIENT_CRASH("kqueue() create failed: "
+				"probably out of file descriptors");
+	}
+	(void)dispatch_assume_zero(epoll_ctl(epfd, EPOLL_CTL_ADD, _dispatch_kq,
+			&ev));
+}
+#else
+#define _dispatch_mgr_fd _dispatch_kq
+
 static void
 _dispatch_get_kq_init(void *context DISPATCH_UNUSED)
 {
@@ -2846,6 +4898,7 @@ _dispatch_get_kq_init(void *context DISPATCH_UNUSED)
 
 	_dispatch_queue_push(_dispatch_mgr_q.do_targetq, &_dispatch_mgr_q);
 }
+#endif // DISPATCH_USE_EPOLL
 
 static int
 _dispatch_get_kq(void)
@@ -2857,6 +4910,266 @@ _dispatch_get_kq(void)
 	return _dispatch_kq;
 }
 
+#if DISPATCH_USE_EPOLL
+#pragma mark -
+#pragma mark dispatch_epoll
+
+// Only accessed on the manager thread
+
+#define DEF_HASH_SIZE 256u // must be a power of two
+#define DEF_HASH(x) ((x) & (DEF_HASH_SIZE - 1))
+
+enum {
+	DEF_READ = 0,
+	DEF_WRITE,
+	DEF_COUNT,
+};
+
+struct dispatch_epoll_fd_s {
+	TAILQ_ENTRY(dispatch_epoll_fd_s) def_list;
+	int def_fd;
+	bool def_registered;
+	uint32_t def_armed;
+	void *def_udata[DEF_COUNT];
+	unsigned short def_flags[DEF_COUNT];
+};
+
+typedef struct dispatch_epoll_fd_s *dispatch_epoll_fd_t;
+
+static TAILQ_HEAD(, dispatch_epoll_fd_s) _dispatch_epoll_fds[DEF_HASH_SIZE];
+
+static const uint32_t _dispatch_epoll_events[DEF_COUNT] = {
+	[DEF_READ] = EPOLLIN,
+	[DEF_WRITE] = EPOLLOUT,
+};
+
+static void
+_dispatch_epoll_fds_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < DEF_HASH_SIZE; i++) {
+		TAILQ_INIT(&_dispatch_epoll_fds[i]);
+	}
+}
+
+static dispatch_epoll_fd_t
+_dispatch_epoll_fd_find(int fd)
+{
+	dispatch_epoll_fd_t def;
+
+	TAILQ_FOREACH(def, &_dispatch_epoll_fds[DEF_HASH((unsigned int)fd)],
+			def_list) {
+		if (def->def_fd == fd) {
+			break;
+		}
+	}
+	return def;
+}
+
+static dispatch_epoll_fd_t
+_dispatch_epoll_fd_create(int fd)
+{
+	dispatch_epoll_fd_t def;
+
+	while (!(def = calloc(1ul, sizeof(struct dispatch_epoll_fd_s)))) {
+		sleep(1);
+	}
+	def->def_fd = fd;
+	TAILQ_INSERT_TAIL(&_dispatch_epoll_fds[DEF_HASH((unsigned int)fd)], def,
+			def_list);
+	return def;
+}
+
+static void
+_dispatch_epoll_fd_dispose(dispatch_epoll_fd_t def)
+{
+	TAILQ_REMOVE(&_dispatch_epoll_fds[DEF_HASH((unsigned int)def->def_fd)],
+			def, def_list);
+	free(def);
+}
+
+// Push the armed directions of a descriptor to the epoll set. Registrations
+// are always EPOLLONESHOT, directions that survive a delivery are re-armed
+// by _dispatch_epoll_merge().
+static int
+_dispatch_epoll_fd_update(dispatch_epoll_fd_t def)
+{
+	struct epoll_event ev = {
+		.events = def->def_armed | EPOLLONESHOT,
+		.data.ptr = def,
+	};
+	int op, r;
+
+	if (def->def_armed & EPOLLIN) {
+		ev.events |= EPOLLRDHUP;
+	}
+	if (!def->def_armed) {
+		if (!def->def_registered) {
+			return 0;
+		}
+		def->def_registered = false;
+		r = epoll_ctl(_dispatch_epfd, EPOLL_CTL_DEL, def->def_fd, NULL);
+		// the descriptor may have been closed and reopened behind our back,
+		// which removed it from the epoll set
+		if (r == -1 && errno == ENOENT) {
+			return 0;
+		}
+		return r == -1 ? errno : 0;
+	}
+	op = def->def_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+retry:
+	r = epoll_ctl(_dispatch_epfd, op, def->def_fd, &ev);
+	if (r == -1) {
+		switch (errno) {
+		case EINTR:
+			goto retry;
+		case ENOENT:
+			if (op == EPOLL_CTL_MOD) {
+				op = EPOLL_CTL_ADD;
+				goto retry;
+			}
+			break;
+		case EEXIST:
+			if (op == EPOLL_CTL_ADD) {
+				op = EPOLL_CTL_MOD;
+				goto retry;
+			}
+			break;
+		}
+		return errno;
+	}
+	def->def_registered = true;
+	return 0;
+}
+
+static long
+_dispatch_epoll_update(const struct kevent *kev)
+{
+	dispatch_epoll_fd_t def;
+	int fd = (int)kev->ident, dir, err;
+	uint32_t event;
+
+	dir = (kev->filter == EVFILT_READ) ? DEF_READ : DEF_WRITE;
+	event = _dispatch_epoll_events[dir];
+	def = _dispatch_epoll_fd_find(fd);
+
+	if (kev->flags & EV_DELETE) {
+		if (!def || !def->def_udata[dir]) {
+			return ENOENT;
+		}
+		def->def_udata[dir] = NULL;
+		def->def_armed &= ~event;
+	} else {
+		if (kev->flags & EV_ADD) {
+			if (!def) {
+				def = _dispatch_epoll_fd_create(fd);
+			}
+			def->def_udata[dir] = kev->udata;
+			def->def_flags[dir] = kev->flags;
+		} else if (!def || !def->def_udata[dir]) {
+			return ENOENT;
+		}
+		if (kev->flags & EV_DISABLE) {
+			def->def_armed &= ~event;
+		} else if (kev->flags & (EV_ADD|EV_ENABLE)) {
+			def->def_armed |= event;
+		}
+	}
+
+	err = _dispatch_epoll_fd_update(def);
+	if (err && !(kev->flags & EV_DELETE)) {
+		// e.g. EPERM for regular files, let the caller fall back to select()
+		def->def_udata[dir] = NULL;
+		def->def_armed &= ~event;
+	}
+	if (!def->def_udata[DEF_READ] && !def->def_udata[DEF_WRITE]) {
+		_dispatch_epoll_fd_dispose(def);
+	}
+	return err;
+}
+
+// Translate an epoll event into at most DEF_COUNT kevents
+static int
+_dispatch_epoll_merge(dispatch_epoll_fd_t def, uint32_t events,
+		struct kevent *kev)
+{
+	unsigned short flags;
+	int dir, n = 0, avail;
+	uint32_t event;
+
+	for (dir = 0; dir < DEF_COUNT; dir++) {
+		event = _dispatch_epoll_events[dir];
+		if (!(def->def_armed & event) ||
+				!(events & (event|EPOLLHUP|EPOLLERR|EPOLLRDHUP))) {
+			continue;
+		}
+		flags = def->def_flags[dir] & (EV_DISPATCH|EV_ONESHOT|EV_CLEAR);
+		if (events & (EPOLLHUP|EPOLLERR) ||
+				(dir == DEF_READ && (events & EPOLLRDHUP))) {
+			flags |= EV_EOF;
+		}
+		if (dir == DEF_READ) {
+			// kevent reports the number of bytes available, epoll does not
+			if (ioctl(def->def_fd, FIONREAD, &avail) == -1 || avail < 0) {
+				avail = (events & EPOLLIN) ? 1 : 0;
+			}
+		} else {
+			// the remaining send buffer space is not available cheaply
+			avail = 1;
+		}
+		EV_SET(&kev[n], (uintptr_t)def->def_fd, dir == DEF_READ ?
+				EVFILT_READ : EVFILT_WRITE, EV_ADD|flags, 0, avail,
+				def->def_udata[dir]);
+		n++;
+		if (flags & (EV_DISPATCH|EV_ONESHOT)) {
+			def->def_armed &= ~event;
+		}
+	}
+	// EPOLLONESHOT disabled every direction of the descriptor
+	if (def->def_armed) {
+		(void)dispatch_assume_zero(_dispatch_epoll_fd_update(def));
+	}
+	return n;
+}
+
+static int
+_dispatch_epoll_wait(struct kevent *kev, int cnt,
+		const struct timespec *timeout)
+{
+	static const struct timespec timeout_immediately = { 0, 0 };
+	struct epoll_event ev[cnt / DEF_COUNT];
+	int i, k, r, ms, n = 0;
+	eventfd_t value;
+
+	if (timeout) {
+		// round up, epoll_wait() has millisecond granularity
+		ms = (int)(timeout->tv_sec * 1000 +
+				(timeout->tv_nsec + 999999) / 1000000);
+	} else {
+		ms = -1;
+	}
+	r = epoll_wait(_dispatch_epfd, ev, cnt / DEF_COUNT, ms);
+	for (i = 0; i < r; i++) {
+		if (ev[i].data.ptr == &_dispatch_eventfd) {
+			(void)eventfd_read(_dispatch_eventfd, &value);
+			EV_SET(&kev[n], 1, EVFILT_USER, 0, 0, 0, NULL);
+			n++;
+		} else if (ev[i].data.ptr == &_dispatch_kq) {
+			// leave room for the remaining epoll events
+			k = kevent(_dispatch_kq, NULL, 0, &kev[n],
+					cnt - n - DEF_COUNT * (r - i - 1), &timeout_immediately);
+			if (k > 0) {
+				n += k;
+			}
+		} else {
+			n += _dispatch_epoll_merge(ev[i].data.ptr, ev[i].events, &kev[n]);
+		}
+	}
+	return r == -1 ? -1 : n;
+}
+#endif // DISPATCH_USE_EPOLL
+
 long
 _dispatch_update_kq(const struct kevent *kev)
 {
@@ -2892,6 +5205,30 @@ _dispatch_update_kq(const struct kevent *kev)
 		}
 	}
 
+#if DISPATCH_USE_EPOLL
+	switch (kev_copy.filter) {
+	case EVFILT_USER:
+		// _dispatch_mgr_wakeup()
+		(void)_dispatch_get_epfd();
+		do {
+			rval = eventfd_write(_dispatch_eventfd, 1);
+		} while (rval == -1 && errno == EINTR);
+		(void)dispatch_assume_zero(rval);
+		return 0;
+	case EVFILT_READ:
+	case EVFILT_WRITE:
+		// Only executed on manager queue
+		(void)_dispatch_get_epfd();
+		kev_copy.data = _dispatch_epoll_update(&kev_copy);
+		if (kev_copy.data == EBADF) {
+			_dispatch_bug_client("Do not close random Unix descriptors");
+		}
+		goto registered;
+	default:
+		break;
+	}
+#endif
+
 retry:
 	rval = kevent(_dispatch_get_kq(), &kev_copy, 1, &kev_copy, 1, NULL);
 	if (rval == -1) {
@@ -2913,6 +5250,9 @@ retry:
 		return err;
 	}
 
+#if DISPATCH_USE_EPOLL
+registered:
+#endif
 	// The following select workaround only applies to adding kevents
 	if ((kev->flags & (EV_DISABLE|EV_DELETE)) ||
 			!(kev->flags & (EV_ADD|EV_ENABLE))) {
@@ -2987,18 +5327,71 @@ _dispatch_mgr_wakeup(dispatch_queue_t dq)
 static void
 _dispatch_mgr_thread2(struct kevent *kev, size_t cnt)
 {
+	bool drain_mgr_q = false;
 	size_t i;
 
 	for (i = 0; i < cnt; i++) {
 		// EVFILT_USER isn't used by sources
 		if (kev[i].filter == EVFILT_USER) {
-				// If _dispatch_mgr_thread2() ever is changed to return to the
-				// caller, then this should become _dispatch_queue_drain()
-				_dispatch_queue_serial_drain_till_empty(&_dispatch_mgr_q);
+			drain_mgr_q = true;
 		} else {
 			_dispatch_source_drain_kevent(&kev[i]);
 		}
 	}
+	// Drain the manager queue once per batch, after all source kevents have
+	// been merged: it may unregister and free kevents later in the batch
+	if (drain_mgr_q) {
+		// If _dispatch_mgr_thread2() ever is changed to return to the
+		// caller, then this should become _dispatch_queue_drain()
+		_dispatch_queue_serial_drain_till_empty(&_dispatch_mgr_q);
+	}
+}
+
+#pragma mark -
+#pragma mark dispatch_mgr_kevent_batch
+
+enum {
+	DISPATCH_MGRCNTL_KEVENT_BATCH = 1,
+};
+
+#ifndef DISPATCH_MGR_KEVENT_BATCH
+#define DISPATCH_MGR_KEVENT_BATCH 64
+#endif
+#define DISPATCH_MGR_KEVENT_BATCH_MIN 2
+#define DISPATCH_MGR_KEVENT_BATCH_MAX 1024
+
+static unsigned int _dispatch_mgr_kevent_batch = DISPATCH_MGR_KEVENT_BATCH;
+
+static void
+_dispatch_mgr_kevent_batch_set(unsigned long batch)
+{
+	if (batch < DISPATCH_MGR_KEVENT_BATCH_MIN) {
+		batch = DISPATCH_MGR_KEVENT_BATCH_MIN;
+	} else if (batch > DISPATCH_MGR_KEVENT_BATCH_MAX) {
+		batch = DISPATCH_MGR_KEVENT_BATCH_MAX;
+	}
+	_dispatch_mgr_kevent_batch = (unsigned int)batch;
+}
+
+static void
+_dispatch_mgr_kevent_batch_init(void)
+{
+	const char *batch = getenv("LIBDISPATCH_MGR_KEVENT_BATCH");
+
+	if (slowpath(batch)) {
+		_dispatch_mgr_kevent_batch_set(strtoul(batch, NULL, 0));
+	}
+}
+
+// Takes effect on the next iteration of the manager loop
+void
+_dispatch_mgrcntl(uint32_t param, uint64_t value)
+{
+	switch (param) {
+	case DISPATCH_MGRCNTL_KEVENT_BATCH:
+		_dispatch_mgr_kevent_batch_set((unsigned long)value);
+		break;
+	}
 }
 
 #if DISPATCH_USE_VM_PRESSURE && DISPATCH_USE_MALLOC_VM_PRESSURE_SOURCE
@@ -3034,8 +5427,8 @@ _dispatch_mgr_invoke(void)
 	const struct timespec *timeoutp;
 	struct timeval sel_timeout, *sel_timeoutp;
 	fd_set tmp_rfds, tmp_wfds;
-	struct kevent kev[1];
-	int k_cnt, err, i, r;
+	struct kevent kev[DISPATCH_MGR_KEVENT_BATCH_MAX];
+	int k_cnt, b_cnt, err, i, r;
 
 	_dispatch_thread_setspecific(dispatch_queue_key, &_dispatch_mgr_q);
 #if DISPATCH_COCOA_COMPAT
@@ -3043,8 +5436,10 @@ _dispatch_mgr_invoke(void)
 	(void)dispatch_atomic_dec(&_dispatch_worker_threads);
 #endif
 	_dispatch_malloc_vm_pressure_setup();
+	_dispatch_mgr_kevent_batch_init();
 
 	for (;;) {
+		b_cnt = (int)_dispatch_mgr_kevent_batch;
 		_dispatch_run_timers();
 
 		timeoutp = _dispatch_get_next_timer_fire(&timeout);
@@ -3071,7 +5466,7 @@ _dispatch_mgr_invoke(void)
 					continue;
 				}
 				for (i = 0; i < FD_SETSIZE; i++) {
-					if (i == _dispatch_kq) {
+					if (i == _dispatch_mgr_fd) {
 						continue;
 					}
 					if (!FD_ISSET(i, &_dispatch_rfds) && !FD_ISSET(i,
@@ -3100,36 +5495,47 @@ _dispatch_mgr_invoke(void)
 			}
 
 			if (r > 0) {
+				k_cnt = 0;
 				for (i = 0; i < FD_SETSIZE; i++) {
-					if (i == _dispatch_kq) {
+					if (i == _dispatch_mgr_fd) {
 						continue;
 					}
+					if (k_cnt + 2 > b_cnt) {
+						_dispatch_mgr_thread2(kev, (size_t)k_cnt);
+						k_cnt = 0;
+					}
 					if (FD_ISSET(i, &tmp_rfds)) {
 						FD_CLR(i, &_dispatch_rfds); // emulate EV_DISABLE
-						EV_SET(&kev[0], i, EVFILT_READ,
+						EV_SET(&kev[k_cnt], i, EVFILT_READ,
 								EV_ADD|EV_ENABLE|EV_DISPATCH, 0, 1,
 								_dispatch_rfd_ptrs[i]);
 						_dispatch_rfd_ptrs[i] = 0;
 						(void)dispatch_atomic_dec(&_dispatch_select_workaround);
-						_dispatch_mgr_thread2(kev, 1);
+						k_cnt++;
 					}
 					if (FD_ISSET(i, &tmp_wfds)) {
 						FD_CLR(i, &_dispatch_wfds); // emulate EV_DISABLE
-						EV_SET(&kev[0], i, EVFILT_WRITE,
+						EV_SET(&kev[k_cnt], i, EVFILT_WRITE,
 								EV_ADD|EV_ENABLE|EV_DISPATCH, 0, 1,
 								_dispatch_wfd_ptrs[i]);
 						_dispatch_wfd_ptrs[i] = 0;
 						(void)dispatch_atomic_dec(&_dispatch_select_workaround);
-						_dispatch_mgr_thread2(kev, 1);
+						k_cnt++;
 					}
 				}
+				if (k_cnt) {
+					_dispatch_mgr_thread2(kev, (size_t)k_cnt);
+				}
 			}
 
 			timeoutp = &timeout_immediately;
 		}
 
-		k_cnt = kevent(_dispatch_kq, NULL, 0, kev, sizeof(kev) / sizeof(kev[0]),
-				timeoutp);
+#if DISPATCH_USE_EPOLL
+		k_cnt = _dispatch_epoll_wait(kev, b_cnt, timeoutp);
+#else
+		k_cnt = kevent(_dispatch_kq, NULL, 0, kev, b_cnt, timeoutp);
+#endif
 		err = errno;
 
 		switch (k_cnt) {
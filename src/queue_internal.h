@@ -50,6 +50,9 @@
 #define DISPATCH_OBJ_BARRIER_BIT	0x2
 #define DISPATCH_OBJ_GROUP_BIT		0x4
 #define DISPATCH_OBJ_SYNC_SLOW_BIT	0x8
+#define DISPATCH_OBJ_INLINE_BIT		0x10
+#define DISPATCH_OBJ_BOUNDED_BIT	0x20
+#define DISPATCH_OBJ_STATS_BIT		0x40 // dc_other holds the enqueue time
 // vtables are pointers far away from the low page in memory
 #define DISPATCH_OBJ_IS_VTABLE(x) ((unsigned long)(x)->do_vtable > 127ul)
 
@@ -59,6 +62,22 @@ struct dispatch_continuation_s {
 
 DISPATCH_DECL(dispatch_continuation);
 
+// Continuations are allocated in slots of this size. The space from dc_data
+// to the end of the slot holds the arguments copied by
+// dispatch_async_inline_f(), such continuations have DISPATCH_OBJ_INLINE_BIT
+// set and are freed only after their function returns. Larger arguments are
+// copied to the heap, building with two cachelines per slot keeps up to
+// 88 bytes inline on LP64 at the cost of doubling the size of every
+// continuation.
+// This is also used for allocating struct dispatch_apply_s, see the asserts
+// in libdispatch_init.
+#ifndef DISPATCH_CONTINUATION_SLOT_SIZE
+#define DISPATCH_CONTINUATION_SLOT_SIZE DISPATCH_CACHELINE_SIZE
+#endif
+#define DISPATCH_CONTINUATION_INLINE_SIZE (DISPATCH_CONTINUATION_SLOT_SIZE - \
+		offsetof(struct dispatch_continuation_s, dc_data))
+#define _dispatch_continuation_inline_args(dc) ((void *)&(dc)->dc_data)
+
 struct dispatch_apply_s {
 	size_t da_index;
 	size_t da_iterations;
@@ -75,23 +94,86 @@ typedef struct dispatch_apply_s *dispatch_apply_t;
 DISPATCH_CLASS_DECL(queue_attr);
 struct dispatch_queue_attr_s {
 	DISPATCH_STRUCT_HEADER(queue_attr);
+	size_t dqa_capacity;
+	unsigned long dqa_overflow;
+	uint32_t dqa_weight;
+	bool dqa_concurrent;
 };
 
+// Pending work items of a queue created with a capacity: submissions are
+// counted in dqc_depth and uncounted when the drain pops them.
+typedef struct dispatch_queue_capacity_s {
+	size_t volatile dqc_depth;
+	size_t dqc_limit;
+	size_t dqc_low_water;
+	unsigned long dqc_overflow;
+	int32_t volatile dqc_waiters;
+	int32_t volatile dqc_gen; // futex word, bumped to wake up waiters
+#if !DISPATCH_USE_FUTEX
+	dispatch_semaphore_t dqc_sema;
+#endif
+} *dispatch_queue_capacity_t;
+
+// Statistics of a queue, see dispatch_queue_enable_stats(). Counters are
+// sharded per CPU so that producers and the drain rarely share a cacheline,
+// dispatch_queue_get_stats() sums the shards.
+struct dispatch_queue_stats_shard_s {
+	uint64_t volatile dqss_enqueued;
+	uint64_t volatile dqss_dequeued;
+	uint64_t volatile dqss_latency[DISPATCH_QUEUE_STATS_BUCKETS];
+	uint64_t volatile dqss_execution[DISPATCH_QUEUE_STATS_BUCKETS];
+} DISPATCH_CACHELINE_ALIGN;
+
+typedef struct dispatch_queue_stats_shards_s {
+	unsigned int dqst_count;
+	struct dispatch_queue_stats_shard_s dqst_shards[];
+} *dispatch_queue_stats_shards_t;
+
 #define DISPATCH_QUEUE_MIN_LABEL_SIZE 64
 
+// Producers exchange dq_items_tail while the draining thread walks
+// dq_items_head and updates dq_running. The fields between them are padded to
+// a cacheline so that every push does not invalidate the consumer side, new
+// consumer side fields go there and do not move the tail.
+#ifndef DISPATCH_QUEUE_SEPARATE_TAIL
+#define DISPATCH_QUEUE_SEPARATE_TAIL 1
+#endif
+
+#if DISPATCH_QUEUE_SEPARATE_TAIL
+#define DISPATCH_QUEUE_HEAD_PAD DISPATCH_CACHELINE_SIZE
 #ifdef __LP64__
+#define DISPATCH_QUEUE_CACHELINE_PAD (6*sizeof(void*))
+#else
 #define DISPATCH_QUEUE_CACHELINE_PAD (4*sizeof(void*))
+#endif
+#else
+#define DISPATCH_QUEUE_HEAD_PAD sizeof(void*)
+#ifdef __LP64__
+#define DISPATCH_QUEUE_CACHELINE_PAD (6*sizeof(void*))
 #else
-#define DISPATCH_QUEUE_CACHELINE_PAD (2*sizeof(void*))
+#define DISPATCH_QUEUE_CACHELINE_PAD (9*sizeof(void*))
+#endif
 #endif
 
 #define DISPATCH_QUEUE_HEADER \
 	uint32_t volatile dq_running; \
 	uint32_t dq_width; \
+	union { \
+		struct { \
+			struct dispatch_object_s *volatile dq_items_head; \
+			unsigned long dq_serialnum; \
+			dispatch_queue_t dq_specific_q; \
+			uint64_t dq_drain_time; \
+			int64_t dq_drain_deficit; \
+			uint32_t dq_drain_items; \
+			uint32_t dq_weight; \
+			struct dispatch_queue_capacity_s *dq_capacity; \
+			struct dispatch_queue_stats_shards_s *volatile dq_stats; \
+		}; \
+		char _dq_head_pad[DISPATCH_QUEUE_HEAD_PAD]; \
+	}; \
 	struct dispatch_object_s *volatile dq_items_tail; \
-	struct dispatch_object_s *volatile dq_items_head; \
-	unsigned long dq_serialnum; \
-	dispatch_queue_t dq_specific_q;
+	unsigned long volatile dq_sync_spin;
 
 DISPATCH_CLASS_DECL(queue);
 struct dispatch_queue_s {
@@ -110,14 +192,18 @@ DISPATCH_CLASS_DECL(queue_specific_queue);
 extern struct dispatch_queue_s _dispatch_mgr_q;
 
 void _dispatch_queue_dispose(dispatch_queue_t dq);
+void _dispatch_queue_attr_dispose(dispatch_queue_attr_t dqa);
 void _dispatch_queue_invoke(dispatch_queue_t dq);
 void _dispatch_queue_push_list_slow(dispatch_queue_t dq,
 		struct dispatch_object_s *obj, unsigned int n);
 void _dispatch_queue_push_slow(dispatch_queue_t dq,
 		struct dispatch_object_s *obj);
+void _dispatch_queue_stats_push(dispatch_queue_t dq,
+		struct dispatch_object_s *head, struct dispatch_object_s *tail);
 dispatch_queue_t _dispatch_wakeup(dispatch_object_t dou);
 void _dispatch_queue_specific_queue_dispose(dispatch_queue_specific_queue_t
 		dqsq);
+void _dispatch_queue_specific_invalidate(void);
 bool _dispatch_queue_probe_root(dispatch_queue_t dq);
 bool _dispatch_mgr_wakeup(dispatch_queue_t dq);
 DISPATCH_NORETURN
@@ -178,6 +264,9 @@ _dispatch_queue_push_list(dispatch_queue_t dq, dispatch_object_t _head,
 		dispatch_object_t _tail, unsigned int n)
 {
 	struct dispatch_object_s *head = _head._do, *tail = _tail._do;
+	if (slowpath(dq->dq_stats)) {
+		_dispatch_queue_stats_push(dq, head, tail);
+	}
 	if (!fastpath(_dispatch_queue_push_list2(dq, head, tail))) {
 		_dispatch_queue_push_list_slow(dq, head, n);
 	}
@@ -188,6 +277,9 @@ static inline void
 _dispatch_queue_push(dispatch_queue_t dq, dispatch_object_t _tail)
 {
 	struct dispatch_object_s *tail = _tail._do;
+	if (slowpath(dq->dq_stats)) {
+		_dispatch_queue_stats_push(dq, tail, tail);
+	}
 	if (!fastpath(_dispatch_queue_push_list2(dq, tail, tail))) {
 		_dispatch_queue_push_slow(dq, tail);
 	}
@@ -250,8 +342,19 @@ _dispatch_queue_init(dispatch_queue_t dq)
 	dq->dq_serialnum = dispatch_atomic_inc(&_dispatch_queue_serial_numbers) - 1;
 }
 
+// The per-thread continuation cache is a bounded magazine: a list linked
+// through do_next where each entry records its depth in the list. Full and
+// partial magazines are exchanged with a global depot (see queue.c).
+#define dc_cache_cnt do_ref_cnt
+
+#ifndef DISPATCH_CONTINUATION_CACHE_LIMIT
+#define DISPATCH_CONTINUATION_CACHE_LIMIT 64
+#endif
+
 dispatch_continuation_t
-_dispatch_continuation_alloc_from_heap(void);
+_dispatch_continuation_alloc_slow(void);
+void
+_dispatch_continuation_free_slow(dispatch_continuation_t dc);
 
 DISPATCH_ALWAYS_INLINE
 static inline dispatch_continuation_t
@@ -274,7 +377,7 @@ _dispatch_continuation_alloc(void)
 
 	dc = fastpath(_dispatch_continuation_alloc_cacheonly());
 	if(!dc) {
-		return _dispatch_continuation_alloc_from_heap();
+		return _dispatch_continuation_alloc_slow();
 	}
 	return dc;
 }
@@ -285,8 +388,15 @@ static inline void
 _dispatch_continuation_free(dispatch_continuation_t dc)
 {
 	dispatch_continuation_t prev_dc;
+	int cnt;
+
 	prev_dc = (dispatch_continuation_t)
 			_dispatch_thread_getspecific(dispatch_cache_key);
+	cnt = prev_dc ? prev_dc->dc_cache_cnt + 1 : 1;
+	if (slowpath(cnt > DISPATCH_CONTINUATION_CACHE_LIMIT)) {
+		return _dispatch_continuation_free_slow(dc);
+	}
+	dc->dc_cache_cnt = cnt;
 	dc->do_next = prev_dc;
 	_dispatch_thread_setspecific(dispatch_cache_key, dc);
 }
@@ -118,6 +118,11 @@ _dispatch_semaphore_dispose(dispatch_object_t dou)
 		DISPATCH_CLIENT_CRASH(
 				"Semaphore/group object deallocated while in use");
 	}
+#if DISPATCH_USE_FUTEX
+	if (dsema->dsema_group_count >= 2) {
+		DISPATCH_CLIENT_CRASH("Group object deallocated while in use");
+	}
+#endif
 
 #if USE_MACH_SEM
 	kern_return_t kr;
@@ -153,10 +158,58 @@ _dispatch_semaphore_debug(dispatch_object_t dou, char *buf, size_t bufsiz)
 	return offset;
 }
 
+// The async waiter list and the decision between handing a signal to an
+// async waiter or to a blocked thread are serialized by a small lock, taken
+// on the slow paths only.
+DISPATCH_ALWAYS_INLINE
+static inline void
+_dispatch_semaphore_async_lock(dispatch_semaphore_t dsema)
+{
+#if DISPATCH_USE_FUTEX
+	_dispatch_futex_lock(&dsema->dsema_async_lock);
+#else
+	while (!dispatch_atomic_cmpxchg2o(dsema, dsema_async_lock, 0, 1)) {
+		_dispatch_hardware_pause();
+	}
+#endif
+}
+
+DISPATCH_ALWAYS_INLINE
+static inline void
+_dispatch_semaphore_async_unlock(dispatch_semaphore_t dsema)
+{
+#if DISPATCH_USE_FUTEX
+	_dispatch_futex_unlock(&dsema->dsema_async_lock);
+#else
+	(void)dispatch_atomic_xchg2o(dsema, dsema_async_lock, 0);
+#endif
+}
+
 DISPATCH_NOINLINE
 long
 _dispatch_semaphore_signal_slow(dispatch_semaphore_t dsema)
 {
+	dispatch_continuation_t dc;
+
+	// Async waiters are served first: they are only ever registered while no
+	// kernel signal is pending, so a signal that finds one needs neither the
+	// kernel nor a thread wakeup.
+	_dispatch_semaphore_async_lock(dsema);
+	dc = dsema->dsema_async_head;
+	if (dc) {
+		dsema->dsema_async_head = dc->do_next;
+		if (!dc->do_next) {
+			dsema->dsema_async_tail = NULL;
+		}
+		_dispatch_semaphore_async_unlock(dsema);
+		dispatch_queue_t dq = dc->dc_data;
+		dispatch_async_f(dq, dc->dc_ctxt, dc->dc_func);
+		_dispatch_release(dq);
+		_dispatch_continuation_free(dc);
+		_dispatch_release(dsema); // the registration's reference
+		return 1;
+	}
+
 	// Before dsema_sent_ksignals is incremented we can rely on the reference
 	// held by the waiter. However, once this value is incremented the waiter
 	// may return between the atomic increment and the semaphore_signal(),
@@ -165,6 +218,7 @@ _dispatch_semaphore_signal_slow(dispatch_semaphore_t dsema)
 	_dispatch_retain(dsema);
 
 	(void)dispatch_atomic_inc2o(dsema, dsema_sent_ksignals);
+	_dispatch_semaphore_async_unlock(dsema);
 
 #if USE_MACH_SEM
 	_dispatch_semaphore_create_port(&dsema->dsema_port);
@@ -304,9 +358,78 @@ dispatch_semaphore_wait(dispatch_semaphore_t dsema, dispatch_time_t timeout)
 	return _dispatch_semaphore_wait_slow(dsema, timeout);
 }
 
+DISPATCH_NOINLINE
+static void
+_dispatch_semaphore_wait_async_slow(dispatch_semaphore_t dsema,
+		dispatch_queue_t dq, void *ctxt, dispatch_function_t func)
+{
+	dispatch_continuation_t dc;
+	size_t orig;
+
+	_dispatch_semaphore_async_lock(dsema);
+	// A signal that raced with the decrement may have found no async waiter
+	// and left a kernel signal behind, claim it rather than waiting for the
+	// next one. The thread waiters' stale kernel wakeup is harmless.
+	while ((orig = dsema->dsema_sent_ksignals)) {
+		if (dispatch_atomic_cmpxchg2o(dsema, dsema_sent_ksignals, orig,
+				orig - 1)) {
+			_dispatch_semaphore_async_unlock(dsema);
+			return dispatch_async_f(dq, ctxt, func);
+		}
+	}
+	dc = _dispatch_continuation_alloc();
+	dc->do_vtable = (void *)DISPATCH_OBJ_ASYNC_BIT;
+	dc->do_next = NULL;
+	dc->dc_func = func;
+	dc->dc_ctxt = ctxt;
+	dc->dc_data = dq;
+	_dispatch_retain(dq);
+	_dispatch_retain(dsema);
+	if (dsema->dsema_async_tail) {
+		dsema->dsema_async_tail->do_next = dc;
+	} else {
+		dsema->dsema_async_head = dc;
+	}
+	dsema->dsema_async_tail = dc;
+	_dispatch_semaphore_async_unlock(dsema);
+}
+
+void
+dispatch_semaphore_wait_async_f(dispatch_semaphore_t dsema,
+		dispatch_queue_t dq, void *ctxt, dispatch_function_t func)
+{
+	long value = dispatch_atomic_dec2o(dsema, dsema_value);
+	dispatch_atomic_acquire_barrier();
+	if (fastpath(value >= 0)) {
+		return dispatch_async_f(dq, ctxt, func);
+	}
+	return _dispatch_semaphore_wait_async_slow(dsema, dq, ctxt, func);
+}
+
+#ifdef __BLOCKS__
+void
+dispatch_semaphore_wait_async(dispatch_semaphore_t dsema, dispatch_queue_t dq,
+		dispatch_block_t db)
+{
+	dispatch_semaphore_wait_async_f(dsema, dq, _dispatch_Block_copy(db),
+			_dispatch_call_block_and_release);
+}
+#endif
+
 #pragma mark -
 #pragma mark dispatch_group_t
 
+DISPATCH_ALWAYS_INLINE
+static inline bool
+_dispatch_group_is_empty(dispatch_semaphore_t dsema)
+{
+#if DISPATCH_USE_FUTEX
+	return dsema->dsema_group_count < 2;
+#else
+	return dsema->dsema_value == dsema->dsema_orig;
+#endif
+}
+
 dispatch_group_t
 dispatch_group_create(void)
 {
@@ -316,19 +439,12 @@ dispatch_group_create(void)
 	return dg;
 }
 
-void
-dispatch_group_enter(dispatch_group_t dg)
-{
-	dispatch_semaphore_t dsema = (dispatch_semaphore_t)dg;
-
-	(void)dispatch_semaphore_wait(dsema, DISPATCH_TIME_FOREVER);
-}
-
 DISPATCH_NOINLINE
 static long
 _dispatch_group_wake(dispatch_semaphore_t dsema)
 {
-	struct dispatch_sema_notify_s *next, *head, *tail = NULL;
+	dispatch_continuation_t next, head, tail = NULL;
+	dispatch_queue_t dq;
 	long rval;
 
 	head = dispatch_atomic_xchg2o(dsema, dsema_notify_head, NULL);
@@ -336,7 +452,12 @@ _dispatch_group_wake(dispatch_semaphore_t dsema)
 		// snapshot before anything is notified/woken <rdar://problem/8554546>
 		tail = dispatch_atomic_xchg2o(dsema, dsema_notify_tail, NULL);
 	}
+#if DISPATCH_USE_FUTEX
+	// waiters are woken by dispatch_group_leave()
+	rval = 0;
+#else
 	rval = dispatch_atomic_xchg2o(dsema, dsema_group_waiters, 0);
+#endif
 	if (rval) {
 		// wake group waiters
 #if USE_MACH_SEM
@@ -355,21 +476,114 @@ _dispatch_group_wake(dispatch_semaphore_t dsema)
 	if (head) {
 		// async group notify blocks
 		do {
-			dispatch_async_f(head->dsn_queue, head->dsn_ctxt, head->dsn_func);
-			_dispatch_release(head->dsn_queue);
-			next = fastpath(head->dsn_next);
+			dq = (dispatch_queue_t)head->dc_data;
+			dispatch_async_f(dq, head->dc_ctxt, head->dc_func);
+			_dispatch_release(dq);
+			next = fastpath(head->do_next);
 			if (!next && head != tail) {
-				while (!(next = fastpath(head->dsn_next))) {
+				while (!(next = fastpath(head->do_next))) {
 					_dispatch_hardware_pause();
 				}
 			}
-			free(head);
+			_dispatch_continuation_free(head);
 		} while ((head = next));
 		_dispatch_release(dsema);
 	}
 	return 0;
 }
 
+#if DISPATCH_USE_FUTEX
+void
+dispatch_group_enter(dispatch_group_t dg)
+{
+	dispatch_semaphore_t dsema = (dispatch_semaphore_t)dg;
+	int32_t value = dispatch_atomic_add2o(dsema, dsema_group_count, 2);
+
+	if (slowpath(value < 2)) {
+		DISPATCH_CLIENT_CRASH("Too many nested calls to dispatch_group_enter()");
+	}
+}
+
+void
+dispatch_group_leave(dispatch_group_t dg)
+{
+	dispatch_semaphore_t dsema = (dispatch_semaphore_t)dg;
+	dispatch_atomic_release_barrier();
+	int32_t value = dispatch_atomic_sub2o(dsema, dsema_group_count, 2);
+	if (slowpath(value < 0)) {
+		DISPATCH_CLIENT_CRASH("Unbalanced call to dispatch_group_leave()");
+	}
+	if (slowpath(value == 1)) {
+		// Wake every waiter even if the group is entered again before they
+		// run, the bumped generation tells them it was empty. If it was
+		// entered again the waiters bit stays and the next empty point
+		// merely wakes nobody.
+		(void)dispatch_atomic_cmpxchg2o(dsema, dsema_group_count, 1, 0);
+		(void)dispatch_atomic_inc2o(dsema, dsema_group_gen);
+		(void)_dispatch_futex_wake(&dsema->dsema_group_gen, INT32_MAX);
+	}
+	if (slowpath(value < 2)) {
+		(void)_dispatch_group_wake(dsema);
+	}
+}
+
+DISPATCH_NOINLINE
+static long
+_dispatch_group_wait_slow(dispatch_semaphore_t dsema, dispatch_time_t timeout)
+{
+	struct timespec _timeout, *tsp = NULL;
+	int32_t value, gen = dsema->dsema_group_gen;
+	uint64_t nsec;
+
+	for (;;) {
+		value = dsema->dsema_group_count;
+		if (value < 2 || dsema->dsema_group_gen != gen) {
+			dispatch_atomic_acquire_barrier();
+			return 0;
+		}
+		// announce the waiter so that the last leave wakes the futex
+		if (!(value & 1) && !dispatch_atomic_cmpxchg2o(dsema,
+				dsema_group_count, value, value | 1)) {
+			continue;
+		}
+		if (timeout != DISPATCH_TIME_FOREVER) {
+			nsec = _dispatch_timeout(timeout);
+			if (!nsec) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			_timeout.tv_sec = (typeof(_timeout.tv_sec))(nsec / NSEC_PER_SEC);
+			_timeout.tv_nsec = (typeof(_timeout.tv_nsec))(nsec % NSEC_PER_SEC);
+			tsp = &_timeout;
+		}
+		(void)_dispatch_futex_wait(&dsema->dsema_group_gen, gen, tsp);
+	}
+}
+
+long
+dispatch_group_wait(dispatch_group_t dg, dispatch_time_t timeout)
+{
+	dispatch_semaphore_t dsema = (dispatch_semaphore_t)dg;
+
+	if (dsema->dsema_group_count < 2) {
+		dispatch_atomic_acquire_barrier();
+		return 0;
+	}
+	if (timeout == 0) {
+		errno = ETIMEDOUT;
+		return (-1);
+	}
+	return _dispatch_group_wait_slow(dsema, timeout);
+}
+#else
+void
+dispatch_group_enter(dispatch_group_t dg)
+{
+	dispatch_semaphore_t dsema = (dispatch_semaphore_t)dg;
+
+	(void)dispatch_semaphore_wait(dsema, DISPATCH_TIME_FOREVER);
+}
+
 void
 dispatch_group_leave(dispatch_group_t dg)
 {
@@ -508,6 +722,7 @@ dispatch_group_wait(dispatch_group_t dg, dispatch_time_t timeout)
 	}
 	return _dispatch_group_wait_slow(dsema, timeout);
 }
+#endif // DISPATCH_USE_FUTEX
 
 DISPATCH_NOINLINE
 void
@@ -515,25 +730,23 @@ dispatch_group_notify_f(dispatch_group_t dg, dispatch_queue_t dq, void *ctxt,
 		void (*func)(void *))
 {
 	dispatch_semaphore_t dsema = (dispatch_semaphore_t)dg;
-	struct dispatch_sema_notify_s *dsn, *prev;
-
-	// FIXME -- this should be updated to use the continuation cache
-	while (!(dsn = (struct dispatch_sema_notify_s *)calloc(1, sizeof(*dsn)))) {
-		sleep(1);
-	}
-
-	dsn->dsn_queue = dq;
-	dsn->dsn_ctxt = ctxt;
-	dsn->dsn_func = func;
+	dispatch_continuation_t dc, prev;
+
+	dc = _dispatch_continuation_alloc();
+	dc->do_vtable = (void *)DISPATCH_OBJ_ASYNC_BIT;
+	dc->do_next = NULL;
+	dc->dc_func = func;
+	dc->dc_ctxt = ctxt;
+	dc->dc_data = dq;
 	_dispatch_retain(dq);
 	dispatch_atomic_store_barrier();
-	prev = dispatch_atomic_xchg2o(dsema, dsema_notify_tail, dsn);
+	prev = dispatch_atomic_xchg2o(dsema, dsema_notify_tail, dc);
 	if (fastpath(prev)) {
-		prev->dsn_next = dsn;
+		prev->do_next = dc;
 	} else {
 		_dispatch_retain(dg);
-		(void)dispatch_atomic_xchg2o(dsema, dsema_notify_head, dsn);
-		if (dsema->dsema_value == dsema->dsema_orig) {
+		(void)dispatch_atomic_xchg2o(dsema, dsema_notify_head, dc);
+		if (_dispatch_group_is_empty(dsema)) {
 			_dispatch_group_wake(dsema);
 		}
 	}
@@ -552,12 +765,26 @@ dispatch_group_notify(dispatch_group_t dg, dispatch_queue_t dq,
 #pragma mark -
 #pragma mark _dispatch_thread_semaphore_t
 
+#if DISPATCH_USE_FUTEX
+// Thread semaphores are futex words: a non-negative value is the number of
+// pending signals, -1 means the owning thread is (about to be) blocked in
+// FUTEX_WAIT. Every thread has one word in TLS, which covers all but nested
+// waits (e.g. a dispatch_sync from a dispatch_apply callout); those fall back
+// to a heap allocated word.
+#ifndef DISPATCH_THREAD_SEMAPHORE_SPINS
+#define DISPATCH_THREAD_SEMAPHORE_SPINS 128
+#endif
+
+static __thread int32_t _dispatch_thread_sema_futex;
+static __thread bool _dispatch_thread_sema_futex_used;
+#endif
+
 DISPATCH_NOINLINE
 static _dispatch_thread_semaphore_t
 _dispatch_thread_semaphore_create(void)
 {
-	_dispatch_safe_fork = false;
 #if USE_MACH_SEM
+	_dispatch_safe_fork = false;
 	semaphore_t s4;
 	kern_return_t kr;
 	while (slowpath(kr = semaphore_create(mach_task_self(), &s4,
@@ -566,7 +793,20 @@ _dispatch_thread_semaphore_create(void)
 		sleep(1);
 	}
 	return s4;
+#elif DISPATCH_USE_FUTEX
+	int32_t *s4;
+	if (fastpath(!_dispatch_thread_sema_futex_used)) {
+		_dispatch_thread_sema_futex_used = true;
+		s4 = &_dispatch_thread_sema_futex;
+	} else {
+		while (!fastpath(s4 = (int32_t *)malloc(sizeof(*s4)))) {
+			sleep(1);
+		}
+	}
+	*s4 = 0;
+	return (_dispatch_thread_semaphore_t)s4;
 #elif USE_POSIX_SEM
+	_dispatch_safe_fork = false;
 	sem_t *s4 = (sem_t *)malloc(sizeof(*s4));
 	int ret = sem_init(s4, 0, 0);
 	DISPATCH_SEMAPHORE_VERIFY_RET(ret);
@@ -582,6 +822,13 @@ _dispatch_thread_semaphore_dispose(_dispatch_thread_semaphore_t sema)
 	semaphore_t s4 = (semaphore_t)sema;
 	kern_return_t kr = semaphore_destroy(mach_task_self(), s4);
 	DISPATCH_SEMAPHORE_VERIFY_KR(kr);
+#elif DISPATCH_USE_FUTEX
+	int32_t *s4 = (int32_t *)sema;
+	if (s4 == &_dispatch_thread_sema_futex) {
+		_dispatch_thread_sema_futex_used = false;
+	} else {
+		free(s4);
+	}
 #elif USE_POSIX_SEM
 	int ret = sem_destroy((sem_t *)sema);
 	free((sem_t *) sema);
@@ -596,6 +843,18 @@ _dispatch_thread_semaphore_signal(_dispatch_thread_semaphore_t sema)
 	semaphore_t s4 = (semaphore_t)sema;
 	kern_return_t kr = semaphore_signal(s4);
 	DISPATCH_SEMAPHORE_VERIFY_KR(kr);
+#elif DISPATCH_USE_FUTEX
+	volatile int32_t *s4 = (volatile int32_t *)sema;
+	int32_t value;
+	do {
+		value = *s4;
+	} while (!fastpath(dispatch_atomic_cmpxchg(s4, value,
+			value < 0 ? 1 : value + 1)));
+	// The waiter may return and reuse the word as soon as it observes the
+	// new value, the wake below only ever touches the address.
+	if (value < 0) {
+		_dispatch_futex_wake(s4, 1);
+	}
 #elif USE_POSIX_SEM
 	int ret = sem_post((sem_t *)sema);
 	DISPATCH_SEMAPHORE_VERIFY_RET(ret);
@@ -612,6 +871,33 @@ _dispatch_thread_semaphore_wait(_dispatch_thread_semaphore_t sema)
 		kr = semaphore_wait(s4);
 	} while (slowpath(kr == KERN_ABORTED));
 	DISPATCH_SEMAPHORE_VERIFY_KR(kr);
+#elif DISPATCH_USE_FUTEX
+	volatile int32_t *s4 = (volatile int32_t *)sema;
+	unsigned int spins = DISPATCH_THREAD_SEMAPHORE_SPINS;
+	int32_t value;
+	for (;;) {
+		value = *s4;
+		if (value > 0) {
+			if (dispatch_atomic_cmpxchg(s4, value, value - 1)) {
+				return;
+			}
+			continue;
+		}
+		if (spins) {
+			spins--;
+			_dispatch_hardware_pause();
+			continue;
+		}
+		if (value == 0 && !dispatch_atomic_cmpxchg(s4, 0, -1)) {
+			continue;
+		}
+		if (_dispatch_futex_wait(s4, -1, NULL) == -1) {
+			int err = errno;
+			if (err != EAGAIN && err != EINTR) {
+				DISPATCH_CRASH("futex wait failed");
+			}
+		}
+	}
 #elif USE_POSIX_SEM
 	int ret;
 	do {
@@ -29,13 +29,6 @@
 
 struct dispatch_queue_s;
 
-struct dispatch_sema_notify_s {
-	struct dispatch_sema_notify_s *volatile dsn_next;
-	struct dispatch_queue_s *dsn_queue;
-	void *dsn_ctxt;
-	void (*dsn_func)(void *);
-};
-
 DISPATCH_CLASS_DECL(semaphore);
 struct dispatch_semaphore_s {
 	DISPATCH_STRUCT_HEADER(semaphore);
@@ -53,8 +46,22 @@ struct dispatch_semaphore_s {
 #error "No supported semaphore type"
 #endif
 	size_t dsema_group_waiters;
-	struct dispatch_sema_notify_s *dsema_notify_head;
-	struct dispatch_sema_notify_s *dsema_notify_tail;
+	// dispatch_semaphore_wait_async_f() records in FIFO order, dc_data is the
+	// queue to submit to. Guarded by dsema_async_lock.
+	int32_t volatile dsema_async_lock;
+	struct dispatch_continuation_s *dsema_async_head;
+	struct dispatch_continuation_s *dsema_async_tail;
+#if DISPATCH_USE_FUTEX
+	// Twice the number of dispatch_group_enter() calls not yet balanced, plus
+	// one while threads wait for the group to become empty
+	int32_t volatile dsema_group_count;
+	// Futex word group waiters block on, bumped each time the last leave
+	// finds the waiters bit set
+	int32_t volatile dsema_group_gen;
+#endif
+	// dispatch_group_notify_f() records: dc_data is the queue to submit to
+	struct dispatch_continuation_s *volatile dsema_notify_head;
+	struct dispatch_continuation_s *volatile dsema_notify_tail;
 };
 
 DISPATCH_CLASS_DECL(group);
@@ -50,6 +50,7 @@ void __builtin_trap(void);
 #endif
 
 #include "shims/atomic.h"
+#include "shims/futex.h"
 #include "shims/getprogname.h"
 #include "shims/hw_config.h"
 #include "shims/malloc_zone.h"
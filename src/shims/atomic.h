@@ -87,6 +87,15 @@
 #define dispatch_atomic_dec2o(p, f) \
 		dispatch_atomic_sub2o((p), f, 1)
 
+#if defined(__ATOMIC_ACQUIRE)
+// C11 memory model builtins (GCC 4.7), for one-way barriers
+#define DISPATCH_ATOMIC_ACQUIRE_RELEASE 1
+#define dispatch_atomic_load_acquire(p) \
+		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define dispatch_atomic_xchg_release(p, n) \
+		__atomic_exchange_n((p), (n), __ATOMIC_RELEASE)
+#endif
+
 #else
 #error "Please upgrade to GCC 4.2 or newer."
 #endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+/*
+ * IMPORTANT: This header file describes INTERNAL interfaces to libdispatch
+ * which are subject to change in future releases of Mac OS X. Any applications
+ * relying on these interfaces WILL break.
+ */
+
+#ifndef __DISPATCH_SHIMS_FUTEX__
+#define __DISPATCH_SHIMS_FUTEX__
+
+#if __linux__ && !defined(DISPATCH_USE_FUTEX)
+#define DISPATCH_USE_FUTEX 1
+#endif
+
+#if DISPATCH_USE_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Blocks while *addr == val, returns 0 when woken, -1 with errno set to
+// EAGAIN (value changed), EINTR or ETIMEDOUT otherwise
+DISPATCH_ALWAYS_INLINE
+static inline int
+_dispatch_futex_wait(volatile int32_t *addr, int32_t val,
+		const struct timespec *timeout)
+{
+	return (int)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout,
+			NULL, 0);
+}
+
+// Wakes up to n threads blocked on addr, returns the number woken
+DISPATCH_ALWAYS_INLINE
+static inline int
+_dispatch_futex_wake(volatile int32_t *addr, int n)
+{
+	return (int)syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// Minimal futex lock: 0 unlocked, 1 locked, 2 locked with waiters
+DISPATCH_ALWAYS_INLINE
+static inline void
+_dispatch_futex_lock(volatile int32_t *lock)
+{
+	if (fastpath(dispatch_atomic_cmpxchg(lock, 0, 1))) {
+		return;
+	}
+	while (dispatch_atomic_xchg(lock, 2) != 0) {
+		(void)_dispatch_futex_wait(lock, 2, NULL);
+	}
+}
+
+DISPATCH_ALWAYS_INLINE
+static inline void
+_dispatch_futex_unlock(volatile int32_t *lock)
+{
+	if (slowpath(dispatch_atomic_xchg(lock, 0) == 2)) {
+		(void)_dispatch_futex_wake(lock, 1);
+	}
+}
+#endif // DISPATCH_USE_FUTEX
+
+#endif /* __DISPATCH_SHIMS_FUTEX__ */
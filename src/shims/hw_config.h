@@ -37,6 +37,106 @@
 #define DISPATCH_SYSCTL_ACTIVE_CPUS		"kern.smp.cpus"
 #endif
 
+#if defined(__linux__)
+#include <sched.h>
+
+#ifndef DISPATCH_CGROUP_ROOT
+#define DISPATCH_CGROUP_ROOT "/sys/fs/cgroup"
+#endif
+
+static inline ssize_t
+_dispatch_hw_config_read(const char *path, char *buf, size_t bufsz)
+{
+	ssize_t len;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1) {
+		return -1;
+	}
+	len = read(fd, buf, bufsz - 1);
+	(void)close(fd);
+	if (len < 0) {
+		return -1;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+// number of CPUs granted by a CFS quota, 0 if unlimited
+static inline uint32_t
+_dispatch_cgroup_quota_cpus(long long quota, long long period)
+{
+	if (quota <= 0 || period <= 0) {
+		return 0;
+	}
+	quota = (quota + period - 1) / period;
+	return quota > UINT32_MAX ? UINT32_MAX : (uint32_t)quota;
+}
+
+// Returns the CPU limit imposed by the cgroup CPU controller, 0 if unlimited.
+// For cgroup v2 the cpu.max of the cgroup and all its ancestors is honored,
+// for cgroup v1 only the cpu controller mounted for the process is looked at.
+static inline uint32_t
+_dispatch_get_cgroup_cpus(void)
+{
+	char buf[PATH_MAX], path[PATH_MAX], max[64], *cg, *end;
+	long long quota, period;
+	uint32_t val = 0, cpus;
+
+	if (_dispatch_hw_config_read("/proc/self/cgroup", buf, sizeof(buf)) < 0) {
+		return 0;
+	}
+	cg = strstr(buf, "0::/");
+	if (cg && (cg == buf || cg[-1] == '\n')) {
+		cg += 3;
+		if ((end = strchr(cg, '\n'))) {
+			*end = '\0';
+		}
+		for (;;) {
+			snprintf(path, sizeof(path), DISPATCH_CGROUP_ROOT "%s/cpu.max", cg);
+			// cg points into buf
+			if (_dispatch_hw_config_read(path, max, sizeof(max)) > 0 &&
+					sscanf(max, "%lld %lld", &quota, &period) == 2) {
+				cpus = _dispatch_cgroup_quota_cpus(quota, period);
+				if (cpus && (!val || cpus < val)) {
+					val = cpus;
+				}
+			}
+			if (!strcmp(cg, "/")) {
+				break;
+			}
+			if (!(end = strrchr(cg, '/'))) {
+				break;
+			}
+			end[end == cg] = '\0';
+		}
+		if (val) {
+			return val;
+		}
+	}
+	if (_dispatch_hw_config_read(DISPATCH_CGROUP_ROOT "/cpu/cpu.cfs_quota_us",
+			buf, sizeof(buf)) > 0 && sscanf(buf, "%lld", &quota) == 1 &&
+			_dispatch_hw_config_read(DISPATCH_CGROUP_ROOT
+			"/cpu/cpu.cfs_period_us", buf, sizeof(buf)) > 0 &&
+			sscanf(buf, "%lld", &period) == 1) {
+		val = _dispatch_cgroup_quota_cpus(quota, period);
+	}
+	return val;
+}
+
+// number of CPUs in the affinity mask of the calling thread, 0 if unknown
+static inline uint32_t
+_dispatch_get_affinity_cpus(void)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set)) {
+		return 0;
+	}
+	return (uint32_t)CPU_COUNT(&set);
+}
+#endif // __linux__
+
 static inline uint32_t
 _dispatch_get_logicalcpu_max()
 {
@@ -94,6 +194,19 @@ _dispatch_get_activecpu()
 			&val, &valsz, NULL, 0);
 	(void)dispatch_assume_zero(ret);
 	(void)dispatch_assume(valsz == sizeof(uint32_t));
+#elif defined(__linux__)
+	// online CPUs, restricted by the affinity mask and the cgroup CPU quota
+	uint32_t cpus;
+	int ret = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	val = ret < 1 ? 1 : (uint32_t)ret;
+	cpus = _dispatch_get_affinity_cpus();
+	if (cpus && cpus < val) {
+		val = cpus;
+	}
+	cpus = _dispatch_get_cgroup_cpus();
+	if (cpus && cpus < val) {
+		val = cpus;
+	}
 #elif HAVE_SYSCONF && defined(_SC_NPROCESSORS_ONLN)
 	int ret = (int)sysconf(_SC_NPROCESSORS_ONLN);
 	val = ret < 0 ? 1 : ret;
@@ -45,6 +45,8 @@ static const unsigned long dispatch_cache_key		= __PTK_LIBDISPATCH_KEY2;
 static const unsigned long dispatch_io_key			= __PTK_LIBDISPATCH_KEY3;
 static const unsigned long dispatch_apply_key		= __PTK_LIBDISPATCH_KEY4;
 static const unsigned long dispatch_bcounter_key	= __PTK_LIBDISPATCH_KEY5;
+static const unsigned long dispatch_deque_key		= __PTK_LIBDISPATCH_KEY6;
+static const unsigned long dispatch_specific_key	= __PTK_LIBDISPATCH_KEY7;
 
 DISPATCH_TSD_INLINE
 static inline void
@@ -59,6 +61,8 @@ extern pthread_key_t dispatch_cache_key;
 extern pthread_key_t dispatch_io_key;
 extern pthread_key_t dispatch_apply_key;
 extern pthread_key_t dispatch_bcounter_key;
+extern pthread_key_t dispatch_deque_key;
+extern pthread_key_t dispatch_specific_key;
 
 DISPATCH_TSD_INLINE
 static inline void
@@ -33,6 +33,7 @@ static bool _dispatch_kevent_resume(dispatch_kevent_t dk, uint32_t new_flags,
 		uint32_t del_flags);
 static inline void _dispatch_source_timer_init(void);
 static void _dispatch_timer_list_update(dispatch_source_t ds);
+static void _dispatch_timer_heap_unlink(dispatch_source_t ds);
 static inline unsigned long _dispatch_source_timer_data(
 		dispatch_source_refs_t dr, unsigned long prev);
 #if HAVE_MACH
@@ -897,13 +898,18 @@ _dispatch_kevent_unregister(dispatch_source_t ds)
 	dispatch_source_refs_t dri;
 	uint32_t del_flags, fflags = 0;
 
+	if (ds->ds_is_timer) {
+		_dispatch_timer_heap_unlink(ds);
+	}
 	ds->ds_dkev = NULL;
 
 	TAILQ_REMOVE(&dk->dk_sources, ds->ds_refs, dr_list);
 
 	if (TAILQ_EMPTY(&dk->dk_sources)) {
 		_dispatch_kevent_dispose(dk);
-	} else {
+	} else if (!ds->ds_is_timer) {
+		// timer lists are never registered with the kernel, so there are no
+		// flags to recompute (and the walk would be linear in armed timers)
 		TAILQ_FOREACH(dri, &dk->dk_sources, dr_list) {
 			dispatch_source_t dsi = _dispatch_source_from_refs(dri);
 			fflags |= (uint32_t)dsi->ds_pending_data_mask;
@@ -1010,12 +1016,197 @@ _dispatch_source_timer_now(dispatch_source_refs_t dr)
 	return _dispatch_source_timer_now2(_dispatch_source_timer_idx(dr));
 }
 
-// Updates the ordered list of timers based on next fire date for changes to ds.
+// Armed timers stay on the dk_sources list of their clock's kevent so that
+// registration, unregistration and debugging can find them, but the firing
+// order is kept in a binary min-heap keyed by target. Arming, rearming and
+// removing a timer is O(log n) and the next timer to fire is always slot 0.
+// All heap state is only ever touched from the context of _dispatch_mgr_q.
+
+// Upper bound on the leeway honored for any timer, in nanoseconds
+#ifndef DISPATCH_TIMER_LEEWAY_MAX
+#define DISPATCH_TIMER_LEEWAY_MAX (60ull * NSEC_PER_SEC)
+#endif
+
+#ifndef DISPATCH_TIMER_HEAP_INITIAL_SIZE
+#define DISPATCH_TIMER_HEAP_INITIAL_SIZE 64u
+#endif
+
+// Heap entries carry their sort key inline so that sifting does not have to
+// chase into the timer refs. An entry refers either to the refs of a timer
+// source, whose 1-based heap slot is kept up to date in the refs, or to a
+// one-shot dispatch_after entry (tagged with DISPATCH_TIMER_HEAP_AFTER).
+struct dispatch_timer_heap_entry_s {
+	uint64_t dte_target;
+	uint64_t dte_leeway;
+	uintptr_t dte_ref;
+};
+
+#define DISPATCH_TIMER_HEAP_AFTER 1ul
+
+struct dispatch_timer_heap_s {
+	struct dispatch_timer_heap_entry_s *dth_heap;
+	unsigned int dth_count;
+	unsigned int dth_size;
+};
+
+static struct dispatch_timer_heap_s _dispatch_timer_heap[DISPATCH_TIMER_COUNT];
+
+DISPATCH_ALWAYS_INLINE
+static inline void
+_dispatch_timer_heap_set(struct dispatch_timer_heap_s *dth, unsigned int idx,
+		const struct dispatch_timer_heap_entry_s *dte)
+{
+	dth->dth_heap[idx] = *dte;
+	if (!(dte->dte_ref & DISPATCH_TIMER_HEAP_AFTER)) {
+		ds_timer_heap_idx((dispatch_source_refs_t)dte->dte_ref) = idx + 1;
+	}
+}
+
+static void
+_dispatch_timer_heap_sift_up(struct dispatch_timer_heap_s *dth,
+		unsigned int idx, struct dispatch_timer_heap_entry_s dte)
+{
+	unsigned int pidx;
+
+	while (idx) {
+		pidx = (idx - 1) / 2;
+		if (dth->dth_heap[pidx].dte_target <= dte.dte_target) {
+			break;
+		}
+		_dispatch_timer_heap_set(dth, idx, &dth->dth_heap[pidx]);
+		idx = pidx;
+	}
+	_dispatch_timer_heap_set(dth, idx, &dte);
+}
+
+static void
+_dispatch_timer_heap_sift_down(struct dispatch_timer_heap_s *dth,
+		unsigned int idx, struct dispatch_timer_heap_entry_s dte)
+{
+	unsigned int cidx, count = dth->dth_count;
+
+	while ((cidx = 2 * idx + 1) < count) {
+		if (cidx + 1 < count && dth->dth_heap[cidx + 1].dte_target <
+				dth->dth_heap[cidx].dte_target) {
+			cidx++;
+		}
+		if (dte.dte_target <= dth->dth_heap[cidx].dte_target) {
+			break;
+		}
+		_dispatch_timer_heap_set(dth, idx, &dth->dth_heap[cidx]);
+		idx = cidx;
+	}
+	_dispatch_timer_heap_set(dth, idx, &dte);
+}
+
+static void
+_dispatch_timer_heap_insert(unsigned int timer, uint64_t target,
+		uint64_t leeway, uintptr_t ref)
+{
+	struct dispatch_timer_heap_s *dth = &_dispatch_timer_heap[timer];
+	struct dispatch_timer_heap_entry_s dte = {
+		.dte_target = target,
+		.dte_leeway = leeway,
+		.dte_ref = ref,
+	}, *heap;
+	unsigned int size;
+
+	if (slowpath(dth->dth_count == dth->dth_size)) {
+		size = dth->dth_size ? 2 * dth->dth_size :
+				DISPATCH_TIMER_HEAP_INITIAL_SIZE;
+		while (!fastpath(heap = realloc(dth->dth_heap, size * sizeof(*heap)))) {
+			sleep(1); // Temporary resource shortage
+		}
+		dth->dth_heap = heap;
+		dth->dth_size = size;
+	}
+	_dispatch_timer_heap_sift_up(dth, dth->dth_count++, dte);
+}
+
+static void
+_dispatch_timer_heap_remove_at(struct dispatch_timer_heap_s *dth,
+		unsigned int idx)
+{
+	struct dispatch_timer_heap_entry_s last;
+
+	dispatch_assert(idx < dth->dth_count);
+	last = dth->dth_heap[--dth->dth_count];
+	if (idx == dth->dth_count) {
+		return;
+	}
+	// Move the last element into the hole and restore the heap property in
+	// whichever direction it is violated.
+	if (idx && last.dte_target < dth->dth_heap[(idx - 1) / 2].dte_target) {
+		_dispatch_timer_heap_sift_up(dth, idx, last);
+	} else {
+		_dispatch_timer_heap_sift_down(dth, idx, last);
+	}
+}
+
+static void
+_dispatch_timer_heap_remove(unsigned int timer, dispatch_source_refs_t dr)
+{
+	struct dispatch_timer_heap_s *dth = &_dispatch_timer_heap[timer];
+	unsigned int idx = ds_timer_heap_idx(dr) - 1;
+
+	dispatch_assert(idx < dth->dth_count &&
+			dth->dth_heap[idx].dte_ref == (uintptr_t)dr);
+	ds_timer_heap_idx(dr) = 0;
+	_dispatch_timer_heap_remove_at(dth, idx);
+}
+
+DISPATCH_ALWAYS_INLINE
+static inline struct dispatch_timer_heap_entry_s *
+_dispatch_timer_heap_first(unsigned int timer)
+{
+	struct dispatch_timer_heap_s *dth = &_dispatch_timer_heap[timer];
+	return dth->dth_count ? &dth->dth_heap[0] : NULL;
+}
+
+// Returns the latest time at which every armed timer of the heap rooted at
+// idx is still within its [target, target + leeway] window, or deadline if
+// that is earlier. Subtrees whose first target is not before the deadline
+// cannot lower it and are skipped, so only timers that will be coalesced
+// into the next wakeup are visited.
+static uint64_t
+_dispatch_timer_heap_deadline(struct dispatch_timer_heap_s *dth,
+		unsigned int idx, uint64_t deadline)
+{
+	struct dispatch_timer_heap_entry_s *dte;
+
+	while (idx < dth->dth_count) {
+		dte = &dth->dth_heap[idx];
+		if (dte->dte_target >= deadline) {
+			break;
+		}
+		if (dte->dte_leeway < deadline - dte->dte_target) {
+			deadline = dte->dte_target + dte->dte_leeway;
+		}
+		deadline = _dispatch_timer_heap_deadline(dth, 2 * idx + 1, deadline);
+		idx = 2 * idx + 2;
+	}
+	return deadline;
+}
+
+// Removes ds from the heap of the timer list it is currently on, if any.
+static void
+_dispatch_timer_heap_unlink(dispatch_source_t ds)
+{
+	dispatch_source_refs_t dr = ds->ds_refs;
+
+	if (ds_timer_heap_idx(dr)) {
+		_dispatch_timer_heap_remove((unsigned int)ds->ds_dkev->dk_kevent.ident,
+				dr);
+	}
+}
+
+// Updates the ordered heap of timers based on next fire date for changes to ds.
 // Should only be called from the context of _dispatch_mgr_q.
 static void
 _dispatch_timer_list_update(dispatch_source_t ds)
 {
-	dispatch_source_refs_t dr = ds->ds_refs, dri = NULL;
+	dispatch_source_refs_t dr = ds->ds_refs;
+	unsigned int timer;
 
 	dispatch_assert(_dispatch_queue_get_current() == &_dispatch_mgr_q);
 
@@ -1028,6 +1219,7 @@ _dispatch_timer_list_update(dispatch_source_t ds)
 	// readded below.
 	_dispatch_kevent_register(ds);
 
+	_dispatch_timer_heap_unlink(ds);
 	TAILQ_REMOVE(&ds->ds_dkev->dk_sources, dr, dr_list);
 
 	// Move timers that are disabled, suspended or have missed intervals to the
@@ -1042,31 +1234,113 @@ _dispatch_timer_list_update(dispatch_source_t ds)
 	}
 
 	// change the list if the clock type has changed
-	ds->ds_dkev = &_dispatch_kevent_timer[_dispatch_source_timer_idx(dr)];
+	timer = _dispatch_source_timer_idx(dr);
+	ds->ds_dkev = &_dispatch_kevent_timer[timer];
+	TAILQ_INSERT_TAIL(&ds->ds_dkev->dk_sources, dr, dr_list);
+	_dispatch_timer_heap_insert(timer, ds_timer(dr).target,
+			ds_timer(dr).leeway, (uintptr_t)dr);
+}
 
-	TAILQ_FOREACH(dri, &ds->ds_dkev->dk_sources, dr_list) {
-		if (ds_timer(dri).target == 0 ||
-				ds_timer(dr).target < ds_timer(dri).target) {
-			break;
+#pragma mark -
+#pragma mark dispatch_timer_after
+
+// One-shot timers for dispatch_after() do not need a dispatch source: the
+// entry is queued on a lock-free list, moved into the timer heap of its clock
+// by the manager and its function is pushed onto the target queue on expiry.
+// Entries are allocated in continuation slots, dc_data is the target queue.
+typedef struct dispatch_timer_after_s {
+	DISPATCH_CONTINUATION_HEADER(timer_after);
+	dispatch_time_t dta_when;
+} *dispatch_timer_after_t;
+
+static dispatch_timer_after_t volatile _dispatch_timer_after_head;
+
+static void
+_dispatch_timer_after_drain(void *ctxt DISPATCH_UNUSED)
+{
+	// Called on the _dispatch_mgr_q
+	dispatch_timer_after_t dta, next;
+
+	dta = dispatch_atomic_xchg(&_dispatch_timer_after_head, NULL);
+	for (; dta; dta = next) {
+		next = dta->do_next;
+		if ((int64_t)dta->dta_when < 0) {
+			_dispatch_timer_heap_insert(DISPATCH_TIMER_INDEX_WALL,
+					(uint64_t)-((int64_t)dta->dta_when), 0,
+					(uintptr_t)dta | DISPATCH_TIMER_HEAP_AFTER);
+		} else {
+			_dispatch_timer_heap_insert(DISPATCH_TIMER_INDEX_MACH,
+					dta->dta_when, 0,
+					(uintptr_t)dta | DISPATCH_TIMER_HEAP_AFTER);
 		}
 	}
+}
 
-	if (dri) {
-		TAILQ_INSERT_BEFORE(dri, dr, dr_list);
-	} else {
-		TAILQ_INSERT_TAIL(&ds->ds_dkev->dk_sources, dr, dr_list);
+static void
+_dispatch_timer_after_fire(dispatch_timer_after_t dta)
+{
+	dispatch_queue_t dq = dta->dc_data;
+	dispatch_function_t func = dta->dc_func;
+	void *ctxt = dta->dc_ctxt;
+
+	// free first, the slot is reused by the async below
+	_dispatch_continuation_free((dispatch_continuation_t)dta);
+	dispatch_async_f(dq, ctxt, func);
+	_dispatch_release(dq);
+}
+
+void
+_dispatch_timer_after(dispatch_time_t when, dispatch_queue_t dq, void *ctxt,
+		dispatch_function_t func)
+{
+	dispatch_timer_after_t dta, head;
+
+	dispatch_assert(sizeof(struct dispatch_timer_after_s) <=
+			DISPATCH_CONTINUATION_SLOT_SIZE);
+	dta = (dispatch_timer_after_t)_dispatch_continuation_alloc();
+	dta->dc_func = func;
+	dta->dc_ctxt = ctxt;
+	dta->dc_data = dq;
+	dta->dta_when = when;
+	_dispatch_retain(dq);
+
+	do {
+		head = _dispatch_timer_after_head;
+		dta->do_next = head;
+	} while (!fastpath(dispatch_atomic_cmpxchg(&_dispatch_timer_after_head,
+			head, dta)));
+	// Only the enqueuer that found the list empty needs to poke the manager,
+	// a single drain picks up everything queued up to that point.
+	if (!head) {
+		dispatch_barrier_async_f(&_dispatch_mgr_q, NULL,
+				_dispatch_timer_after_drain);
 	}
 }
 
+#pragma mark -
+#pragma mark dispatch_timer
+
 static inline void
 _dispatch_run_timers2(unsigned int timer)
 {
+	struct dispatch_timer_heap_entry_s *dte;
 	dispatch_source_refs_t dr;
 	dispatch_source_t ds;
 	uint64_t now, missed;
 
 	now = _dispatch_source_timer_now2(timer);
-	while ((dr = TAILQ_FIRST(&_dispatch_kevent_timer[timer].dk_sources))) {
+	while ((dte = _dispatch_timer_heap_first(timer))) {
+		if (dte->dte_ref & DISPATCH_TIMER_HEAP_AFTER) {
+			if (dte->dte_target > now) {
+				break;
+			}
+			dispatch_timer_after_t dta = (dispatch_timer_after_t)
+					(dte->dte_ref & ~DISPATCH_TIMER_HEAP_AFTER);
+			_dispatch_timer_heap_remove_at(&_dispatch_timer_heap[timer], 0);
+			_dispatch_timer_after_fire(dta);
+			continue;
+		}
+		dr = (dispatch_source_refs_t)dte->dte_ref;
 		ds = _dispatch_source_from_refs(dr);
 		// We may find timers on the wrong list due to a pending update from
 		// dispatch_source_set_timer. Force an update of the list in that case.
@@ -1074,11 +1348,7 @@ _dispatch_run_timers2(unsigned int timer)
 			_dispatch_timer_list_update(ds);
 			continue;
 		}
-		if (!ds_timer(dr).target) {
-			// no configured timers on the list
-			break;
-		}
-		if (ds_timer(dr).target > now) {
+		if (dte->dte_target > now) {
 			// Done running timers for now.
 			break;
 		}
@@ -1109,7 +1379,7 @@ _dispatch_run_timers(void)
 
 	unsigned int i;
 	for (i = 0; i < DISPATCH_TIMER_COUNT; i++) {
-		if (!TAILQ_EMPTY(&_dispatch_kevent_timer[i].dk_sources)) {
+		if (_dispatch_timer_heap[i].dth_count) {
 			_dispatch_run_timers2(i);
 		}
 	}
@@ -1138,27 +1408,31 @@ _dispatch_get_next_timer_fire(struct timespec *howsoon)
 	// <rdar://problem/6459649>
 	// kevent(2) does not allow large timeouts, so we use a long timeout
 	// instead (approximately 1 year).
-	dispatch_source_refs_t dr = NULL;
+	struct dispatch_timer_heap_entry_s *dte;
 	unsigned int timer;
-	uint64_t now, delta_tmp, delta = UINT64_MAX;
+	uint64_t now, deadline, delta_tmp, delta = UINT64_MAX;
 
 	for (timer = 0; timer < DISPATCH_TIMER_COUNT; timer++) {
-		// Timers are kept in order, first one will fire next
-		dr = TAILQ_FIRST(&_dispatch_kevent_timer[timer].dk_sources);
-		if (!dr || !ds_timer(dr).target) {
-			// Empty list or disabled timer
+		// Timers are kept in a min-heap, first one will fire next
+		dte = _dispatch_timer_heap_first(timer);
+		if (!dte) {
+			// No armed timers
 			continue;
 		}
-		now = _dispatch_source_timer_now(dr);
-		if (ds_timer(dr).target <= now) {
+		now = _dispatch_source_timer_now2(timer);
+		if (dte->dte_target <= now) {
 			howsoon->tv_sec = 0;
 			howsoon->tv_nsec = 0;
 			return howsoon;
 		}
-		// the subtraction cannot go negative because the previous "if"
-		// verified that the target is greater than now.
-		delta_tmp = ds_timer(dr).target - now;
-		if (!(ds_timer(dr).flags & DISPATCH_TIMER_WALL_CLOCK)) {
+		// Sleep until the last moment that honors the leeway of every timer
+		// due by then, _dispatch_run_timers() fires all of them in one go.
+		deadline = _dispatch_timer_heap_deadline(&_dispatch_timer_heap[timer],
+				0, UINT64_MAX);
+		// the subtraction cannot go negative because the deadline is never
+		// before the first target, which is greater than now.
+		delta_tmp = deadline - now;
+		if (timer == DISPATCH_TIMER_INDEX_MACH) {
 			delta_tmp = _dispatch_time_mach2nano(delta_tmp);
 		}
 		if (delta_tmp < delta) {
@@ -1231,6 +1505,14 @@ dispatch_source_set_timer(dispatch_source_t ds,
 	if ((int64_t)leeway < 0) {
 		leeway = INT64_MAX;
 	}
+	// a repeating timer may not slip by more than half its interval, and no
+	// timer may be deferred indefinitely by coalescing
+	if (interval < INT64_MAX && leeway > interval / 2) {
+		leeway = interval / 2;
+	}
+	if (leeway > DISPATCH_TIMER_LEEWAY_MAX) {
+		leeway = DISPATCH_TIMER_LEEWAY_MAX;
+	}
 
 	if (start == DISPATCH_TIME_NOW) {
 		start = _dispatch_absolute_time();
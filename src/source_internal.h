@@ -111,6 +111,7 @@ typedef struct dispatch_source_refs_s *dispatch_source_refs_t;
 struct dispatch_timer_source_refs_s {
 	struct dispatch_source_refs_s _ds_refs;
 	struct dispatch_timer_source_s _ds_timer;
+	unsigned int _ds_heap_idx; // 1-based slot in the timer heap, 0 if unheaped
 };
 
 #define _dispatch_ptr2wref(ptr) (~(uintptr_t)(ptr))
@@ -119,6 +120,8 @@ struct dispatch_timer_source_refs_s {
 		((dispatch_source_t)_dispatch_wref2ptr((dr)->dr_source_wref))
 #define ds_timer(dr) \
 		(((struct dispatch_timer_source_refs_s *)(dr))->_ds_timer)
+#define ds_timer_heap_idx(dr) \
+		(((struct dispatch_timer_source_refs_s *)(dr))->_ds_heap_idx)
 
 // ds_atomic_flags bits
 #define DSF_CANCELED 1u // cancellation has been requested
@@ -145,6 +145,16 @@ _dispatch_queue_push_notrace(dispatch_queue_t dq, dispatch_object_t dou)
 #define _dispatch_queue_push_list _dispatch_trace_queue_push_list
 #define _dispatch_queue_push _dispatch_trace_queue_push
 
+DISPATCH_ALWAYS_INLINE
+static inline void
+_dispatch_trace_continuation_push(dispatch_queue_t dq,
+		dispatch_object_t dou)
+{
+	if (slowpath(DISPATCH_QUEUE_PUSH_ENABLED())) {
+		_dispatch_trace_continuation(dq, dou._do, DISPATCH_QUEUE_PUSH);
+	}
+}
+
 DISPATCH_ALWAYS_INLINE
 static inline void
 _dispatch_trace_continuation_pop(dispatch_queue_t dq,
@@ -157,6 +167,7 @@ _dispatch_trace_continuation_pop(dispatch_queue_t dq,
 #else
 
 #define _dispatch_queue_push_notrace _dispatch_queue_push
+#define _dispatch_trace_continuation_push(dq, dou) (void)(dq)
 #define _dispatch_trace_continuation_pop(dq, dou) (void)(dq)
 
 #endif // DISPATCH_USE_DTRACE && !__OBJC2__
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+#include <config/config.h>
+
+#include <dispatch/dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+#define COUNT 10000
+
+static long hits[COUNT];
+static void *contexts[COUNT];
+static volatile long done, out_of_order;
+static long next_serial;
+
+static void
+concurrent_work(void *ctxt)
+{
+	__sync_add_and_fetch((long *)ctxt, 1);
+	__sync_add_and_fetch(&done, 1);
+}
+
+static void
+serial_work(void *ctxt)
+{
+	long idx = (long *)ctxt - hits;
+
+	if (idx != next_serial++) {
+		out_of_order++;
+	}
+}
+
+int
+main(void)
+{
+	dispatch_test_start("Dispatch Async Batch");
+
+	dispatch_queue_t q = dispatch_get_global_queue(0, 0);
+	test_ptr_notnull("dispatch_get_global_queue", q);
+	dispatch_queue_t sq = dispatch_queue_create("com.example.batch", NULL);
+	test_ptr_notnull("dispatch_queue_create", sq);
+
+	long i, missed = 0;
+	for (i = 0; i < COUNT; i++) {
+		contexts[i] = &hits[i];
+	}
+
+	dispatch_async_batch_f(q, COUNT, contexts, concurrent_work);
+	dispatch_async_batch_f(q, 0, contexts, concurrent_work);
+	while (done < COUNT) {
+		usleep(1000);
+	}
+	for (i = 0; i < COUNT; i++) {
+		if (hits[i] != 1) {
+			missed++;
+		}
+	}
+	test_long("concurrent: every context invoked once", missed, 0);
+
+	dispatch_async_batch_f(sq, COUNT, contexts, serial_work);
+	dispatch_sync(sq, ^{
+		test_long("serial: invocations", next_serial, COUNT);
+		test_long("serial: out of order", out_of_order, 0);
+	});
+
+	__block long block_count = 0;
+	dispatch_block_t blocks[16];
+	for (i = 0; i < 16; i++) {
+		long idx = i;
+		blocks[i] = ^{
+			if (block_count++ != idx) {
+				out_of_order++;
+			}
+		};
+	}
+	dispatch_async_batch(sq, 16, blocks);
+	dispatch_sync(sq, ^{
+		test_long("blocks: invocations", block_count, 16);
+		test_long("blocks: out of order", out_of_order, 0);
+	});
+	dispatch_release(sq);
+
+	test_stop();
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+#include <config/config.h>
+
+#include <dispatch/dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+#define COUNT 10000
+#define NESTED 1000
+// small enough to be stored in the continuation with one cacheline slots
+#define VALUES 2
+
+struct small_args {
+	long index;
+	long values[VALUES];
+};
+
+struct large_args {
+	long index;
+	char bytes[1000];
+};
+
+static volatile long done, corrupted;
+static long next_serial, out_of_order;
+
+static void
+small_work(void *ctxt)
+{
+	struct small_args *args = ctxt;
+	long i;
+
+	for (i = 0; i < VALUES; i++) {
+		if (args->values[i] != args->index * i) {
+			__sync_add_and_fetch(&corrupted, 1);
+		}
+	}
+	__sync_add_and_fetch(&done, 1);
+}
+
+static void
+serial_work(void *ctxt)
+{
+	struct small_args *args = ctxt;
+
+	if (args->index != next_serial++) {
+		out_of_order++;
+	}
+	small_work(ctxt);
+}
+
+static void
+large_work(void *ctxt)
+{
+	struct large_args *args = ctxt;
+
+	if (args->bytes[sizeof(args->bytes) - 1] != (char)args->index) {
+		__sync_add_and_fetch(&corrupted, 1);
+	}
+	__sync_add_and_fetch(&done, 1);
+}
+
+static void
+count_work(void *ctxt __attribute__((unused)))
+{
+	__sync_add_and_fetch(&done, 1);
+}
+
+// The continuation of an async item is back in the cache while it runs, so
+// the inline submission below reuses it.
+static void
+nested_work(void *ctxt)
+{
+	dispatch_queue_t nq = ctxt;
+	struct small_args small = { .index = 0 };
+
+	dispatch_async_inline_f(nq, small_work, &small, sizeof(small));
+	dispatch_async_f(nq, NULL, count_work);
+}
+
+static void
+check_serial(void *ctxt __attribute__((unused)))
+{
+	test_long("serial: out of order", out_of_order, 0);
+}
+
+int
+main(void)
+{
+	dispatch_test_start("Dispatch Async Inline");
+
+	dispatch_queue_t q = dispatch_get_global_queue(0, 0);
+	test_ptr_notnull("dispatch_get_global_queue", q);
+	dispatch_queue_t sq = dispatch_queue_create("com.example.inline", NULL);
+	test_ptr_notnull("dispatch_queue_create", sq);
+
+	struct small_args small;
+	struct large_args large;
+	long i, j;
+
+	for (i = 0; i < COUNT; i++) {
+		small.index = i;
+		for (j = 0; j < VALUES; j++) {
+			small.values[j] = i * j;
+		}
+		dispatch_async_inline_f(q, small_work, &small, sizeof(small));
+		dispatch_async_inline_f(sq, serial_work, &small, sizeof(small));
+		// the caller's copy may be reused right away
+		memset(&small, 0xff, sizeof(small));
+	}
+	for (i = 0; i < 100; i++) {
+		large.index = i;
+		large.bytes[sizeof(large.bytes) - 1] = (char)i;
+		dispatch_async_inline_f(q, large_work, &large, sizeof(large));
+	}
+	dispatch_queue_t nq = dispatch_queue_create("com.example.nested", NULL);
+	test_ptr_notnull("dispatch_queue_create", nq);
+	for (i = 0; i < NESTED; i++) {
+		dispatch_async_f(q, nq, nested_work);
+	}
+	dispatch_sync_f(sq, NULL, check_serial);
+	while (done < 2 * COUNT + 100 + 2 * NESTED) {
+		usleep(1000);
+	}
+	test_long("invocations", done, 2 * COUNT + 100 + 2 * NESTED);
+	test_long("corrupted arguments", corrupted, 0);
+	dispatch_release(nq);
+	dispatch_release(sq);
+
+	test_stop();
+
+	return 0;
+}
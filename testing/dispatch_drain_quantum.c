@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+#include <config/config.h>
+
+#include <dispatch/dispatch.h>
+#include <dispatch/private.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+// Serial queues sharing a target with a drain quantum of one item must be
+// serviced in round-robin order instead of each draining to completion.
+
+#define QUEUES	4
+#define COUNT	8
+#define TIMED_COUNT	1000
+
+static dispatch_queue_t tq, q[QUEUES];
+static char order[QUEUES * COUNT + 1];
+static size_t position;
+static long timed_items;
+
+static void
+nop(void *ctxt __attribute__((unused)))
+{
+}
+
+static dispatch_queue_t
+create_queue(const char *label)
+{
+	dispatch_queue_t dq = dispatch_queue_create(label, NULL);
+
+	test_ptr_notnull("dispatch_queue_create", dq);
+	dispatch_set_target_queue(dq, tq);
+	// wait for the new target queue to be applied
+	dispatch_sync_f(dq, NULL, nop);
+	return dq;
+}
+
+static void
+timed_work(void *ctxt __attribute__((unused)))
+{
+	timed_items++;
+	usleep(1000);
+}
+
+static void
+check_timed(void *ctxt __attribute__((unused)))
+{
+	// 10ms worth of items, the timed queue must not have run to completion
+	test_long_less_than("timed queue items before yield", timed_items,
+			TIMED_COUNT / 10);
+	test_stop();
+}
+
+static void
+test_timed(void)
+{
+	dispatch_queue_t timed, other;
+	long i;
+
+	timed = create_queue("com.example.quantum.timed");
+	dispatch_queue_set_drain_quantum(timed, 0, 10 * NSEC_PER_MSEC);
+	other = create_queue("com.example.quantum.other");
+
+	// Both queues are pushed to the suspended target, the timed one first
+	dispatch_suspend(tq);
+	for (i = 0; i < TIMED_COUNT; i++) {
+		dispatch_async_f(timed, NULL, timed_work);
+	}
+	dispatch_async_f(other, NULL, check_timed);
+	dispatch_release(timed);
+	dispatch_release(other);
+	dispatch_resume(tq);
+}
+
+static void
+check_order(void *ctxt __attribute__((unused)))
+{
+	long i, mismatches = 0;
+
+	printf("order: %s\n", order);
+	for (i = 0; i < QUEUES * COUNT; i++) {
+		if (order[i] != 'A' + i % QUEUES) {
+			mismatches++;
+		}
+	}
+	test_long("round-robin order mismatches", mismatches, 0);
+	for (i = 0; i < QUEUES; i++) {
+		dispatch_release(q[i]);
+	}
+	test_timed();
+}
+
+static void
+record(void *ctxt)
+{
+	order[position++] = (char)(intptr_t)ctxt;
+	if (position == QUEUES * COUNT) {
+		dispatch_async_f(dispatch_get_main_queue(), NULL, check_order);
+	}
+}
+
+int
+main(void)
+{
+	long i, j;
+
+	dispatch_test_start("Dispatch Drain Quantum");
+
+	tq = dispatch_queue_create("com.example.quantum.target", NULL);
+	test_ptr_notnull("dispatch_queue_create", tq);
+
+	for (i = 0; i < QUEUES; i++) {
+		q[i] = create_queue("com.example.quantum");
+		dispatch_queue_set_drain_quantum(q[i], 1, 0);
+	}
+
+	// All queues are pushed to the suspended target before it drains any
+	dispatch_suspend(tq);
+	for (i = 0; i < QUEUES; i++) {
+		for (j = 0; j < COUNT; j++) {
+			dispatch_async_f(q[i], (void *)(intptr_t)('A' + i), record);
+		}
+	}
+	dispatch_resume(tq);
+
+	dispatch_main();
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+#include <config/config.h>
+
+#if HAVE_MACH
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#endif
+#include <dispatch/dispatch.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+// Waiters and notifications of a group are all released by the last leave,
+// and a scatter/gather round trip measures the cost of a group.
+
+#define WAITERS		8
+#define NOTIFICATIONS	100
+#define ROUNDS		10000ul
+#define FANOUT		16ul
+
+static dispatch_group_t group;
+static long volatile woken, notified;
+#if HAVE_MACH
+static mach_timebase_info_data_t tbi;
+#endif
+
+static uint64_t
+elapsed_ns(uint64_t since)
+{
+	uint64_t delta = _dispatch_monotonic_time() - since;
+#if HAVE_MACH
+	delta *= tbi.numer;
+	delta /= tbi.denom;
+#endif
+	return delta;
+}
+
+static void *
+waiter(void *context __attribute__((unused)))
+{
+	if (!dispatch_group_wait(group, DISPATCH_TIME_FOREVER)) {
+		(void)__sync_add_and_fetch(&woken, 1);
+	}
+	return NULL;
+}
+
+static void
+notify(void *context __attribute__((unused)))
+{
+	(void)__sync_add_and_fetch(&notified, 1);
+}
+
+static void
+nop(void *context __attribute__((unused)))
+{
+}
+
+static void
+test_wake_all(void)
+{
+	pthread_t threads[WAITERS];
+	dispatch_queue_t q = dispatch_queue_create("com.example.group", NULL);
+	dispatch_group_t done = dispatch_group_create();
+	long i;
+	int r;
+
+	group = dispatch_group_create();
+	dispatch_group_enter(group);
+	dispatch_group_enter(group);
+	for (i = 0; i < WAITERS; i++) {
+		r = pthread_create(&threads[i], NULL, waiter, NULL);
+		assert(r == 0);
+	}
+	for (i = 0; i < NOTIFICATIONS; i++) {
+		dispatch_group_notify_f(group, q, NULL, notify);
+	}
+	usleep(10000);
+	test_long("waiters before leave", woken, 0);
+	test_long("notifications before leave", notified, 0);
+	dispatch_group_leave(group);
+	usleep(10000);
+	test_long("waiters before last leave", woken, 0);
+	dispatch_group_leave(group);
+	for (i = 0; i < WAITERS; i++) {
+		r = pthread_join(threads[i], NULL);
+		assert(r == 0);
+	}
+	test_long("waiters woken", woken, WAITERS);
+	dispatch_group_notify_f(group, q, NULL, notify);
+	dispatch_group_enter(done);
+	dispatch_group_notify_f(group, q, done, (dispatch_function_t)
+			dispatch_group_leave);
+	test_long("wait for notifications",
+			dispatch_group_wait(done, dispatch_time(DISPATCH_TIME_NOW,
+			10 * NSEC_PER_SEC)), 0);
+	test_long("notifications", notified, NOTIFICATIONS + 1);
+
+	dispatch_release(done);
+	dispatch_release(group);
+	dispatch_release(q);
+}
+
+// A waiter must return once the group was empty, even if it is entered
+// again right away
+static void
+test_reenter(void)
+{
+	pthread_t threads[WAITERS];
+	long i;
+	int r;
+
+	woken = 0;
+	group = dispatch_group_create();
+	dispatch_group_enter(group);
+	for (i = 0; i < WAITERS; i++) {
+		r = pthread_create(&threads[i], NULL, waiter, NULL);
+		assert(r == 0);
+	}
+	usleep(10000);
+	dispatch_group_leave(group);
+	dispatch_group_enter(group);
+	for (i = 0; i < WAITERS; i++) {
+		r = pthread_join(threads[i], NULL);
+		assert(r == 0);
+	}
+	test_long("waiters woken by a transient empty point", woken, WAITERS);
+	dispatch_group_leave(group);
+	dispatch_release(group);
+}
+
+static void
+test_timeout(void)
+{
+	group = dispatch_group_create();
+	dispatch_group_enter(group);
+	test_long_greater_than_or_equal("wait times out",
+			labs(dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW,
+			50 * NSEC_PER_MSEC))), 1);
+	dispatch_group_leave(group);
+	test_long("wait after leave", dispatch_group_wait(group,
+			DISPATCH_TIME_NOW), 0);
+	dispatch_release(group);
+}
+
+static void
+test_scatter_gather(void)
+{
+	dispatch_queue_t gq = dispatch_get_global_queue(0, 0);
+	dispatch_group_t dg;
+	uint64_t start, delta;
+	unsigned long i, j;
+	long failures = 0;
+
+	start = _dispatch_monotonic_time();
+	for (i = 0; i < ROUNDS; i++) {
+		dg = dispatch_group_create();
+		for (j = 0; j < FANOUT; j++) {
+			dispatch_group_async_f(dg, gq, NULL, nop);
+		}
+		failures += dispatch_group_wait(dg, DISPATCH_TIME_FOREVER) != 0;
+		dispatch_release(dg);
+	}
+	delta = elapsed_ns(start) / ROUNDS;
+	printf("scatter/gather: %"PRIu64" ns / round of %lu\n", delta, FANOUT);
+	test_long("scatter/gather failures", failures, 0);
+}
+
+int
+main(void)
+{
+	dispatch_test_start("Dispatch Group Wake");
+#if HAVE_MACH
+	kern_return_t kr = mach_timebase_info(&tbi);
+	assert(kr == 0);
+#endif
+
+	test_wake_all();
+	test_reenter();
+	test_timeout();
+	test_scatter_gather();
+
+	test_stop();
+
+	return 0;
+}
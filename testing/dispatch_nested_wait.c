@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+#include <dispatch/dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+// Work items on a global queue submit a child to the same queue and block
+// until it has run. The child goes to the parent's own worker deque, so
+// another thread has to be woken to run it.
+
+#define PARENTS 32
+
+static long volatile finished;
+
+static void
+child(void *context)
+{
+	dispatch_semaphore_signal(context);
+}
+
+static void
+parent(void *context __attribute__((unused)))
+{
+	dispatch_semaphore_t sema = dispatch_semaphore_create(0);
+
+	dispatch_async_f(dispatch_get_global_queue(0, 0), sema, child);
+	dispatch_semaphore_wait(sema, DISPATCH_TIME_FOREVER);
+	dispatch_release(sema);
+	(void)__sync_add_and_fetch(&finished, 1);
+}
+
+int
+main(void)
+{
+	long i;
+
+	dispatch_test_start("Dispatch Nested Wait");
+
+	for (i = 0; i < PARENTS; i++) {
+		dispatch_async_f(dispatch_get_global_queue(0, 0), NULL, parent);
+	}
+	for (i = 0; i < 100 && finished < PARENTS; i++) {
+		usleep(100000);
+	}
+	test_long("parents finished", finished, PARENTS);
+
+	test_stop();
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+#include <config/config.h>
+
+#if HAVE_MACH
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#endif
+#include <dispatch/dispatch.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+// Measures the cost of dispatch_once_f() when several threads race for the
+// first call of a slow initializer, and of the calls after it has run.
+
+#define THREADS		8ul
+#define ROUNDS		100ul
+#define INIT_US		100
+#define STEADY_CALLS	10000000ul
+#define ACCEPTABLE_STEADY_NS 20
+
+static dispatch_once_t preds[ROUNDS], steady_pred;
+static long initialized[ROUNDS];
+static long volatile calls[ROUNDS];
+static long volatile observed_uninitialized;
+static pthread_barrier_t barrier;
+#if HAVE_MACH
+static mach_timebase_info_data_t tbi;
+#endif
+
+static uint64_t
+elapsed_ns(uint64_t since)
+{
+	uint64_t delta = _dispatch_monotonic_time() - since;
+#if HAVE_MACH
+	delta *= tbi.numer;
+	delta /= tbi.denom;
+#endif
+	return delta;
+}
+
+static void
+slow_init(void *context)
+{
+	long round = (long)context;
+
+	(void)__sync_add_and_fetch(&calls[round], 1);
+	usleep(INIT_US);
+	initialized[round] = 1;
+}
+
+static void
+nop_init(void *context __attribute__((unused)))
+{
+}
+
+static void *
+racer(void *context __attribute__((unused)))
+{
+	unsigned long round;
+
+	for (round = 0; round < ROUNDS; round++) {
+		pthread_barrier_wait(&barrier);
+		dispatch_once_f(&preds[round], (void *)round, slow_init);
+		if (!initialized[round]) {
+			(void)__sync_add_and_fetch(&observed_uninitialized, 1);
+		}
+	}
+	return NULL;
+}
+
+int
+main(void)
+{
+	pthread_t threads[THREADS];
+	uint64_t start, contended_ns, steady_ns;
+	unsigned long i;
+	long extra_calls = 0;
+	int r;
+
+	dispatch_test_start("Dispatch Once Contention");
+#if HAVE_MACH
+	kern_return_t kr = mach_timebase_info(&tbi);
+	assert(kr == 0);
+#endif
+
+	r = pthread_barrier_init(&barrier, NULL, THREADS);
+	assert(r == 0);
+	start = _dispatch_monotonic_time();
+	for (i = 0; i < THREADS; i++) {
+		r = pthread_create(&threads[i], NULL, racer, NULL);
+		assert(r == 0);
+	}
+	for (i = 0; i < THREADS; i++) {
+		r = pthread_join(threads[i], NULL);
+		assert(r == 0);
+	}
+	contended_ns = elapsed_ns(start) / ROUNDS;
+	for (i = 0; i < ROUNDS; i++) {
+		extra_calls += calls[i] - 1;
+	}
+	printf("contended first call: %"PRIu64" ns / round of %lu threads "
+			"(initializer: %d us)\n", contended_ns, THREADS, INIT_US);
+	test_long("initializers called more than once", extra_calls, 0);
+	test_long("callers returning before initialization",
+			observed_uninitialized, 0);
+
+	dispatch_once_f(&steady_pred, NULL, nop_init);
+	start = _dispatch_monotonic_time();
+	for (i = 0; i < STEADY_CALLS; i++) {
+		dispatch_once_f(&steady_pred, NULL, nop_init);
+		__asm__ __volatile__("" ::: "memory");
+	}
+	steady_ns = elapsed_ns(start) / STEADY_CALLS;
+	printf("steady state: %"PRIu64" ns / call\n", steady_ns);
+	test_long_less_than("steady state latency (ns)", (long)steady_ns,
+			ACCEPTABLE_STEADY_NS);
+
+	test_stop();
+
+	return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+#include <config/config.h>
+
+#include <dispatch/dispatch.h>
+#include <dispatch/private.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+#define CAPACITY	8
+#define COUNT		200
+
+static long submitted, started, max_pending;
+static long ran[COUNT];
+
+static void
+nop(void *ctxt __attribute__((unused)))
+{
+}
+
+static void
+slow_work(void *ctxt __attribute__((unused)))
+{
+	__sync_add_and_fetch(&started, 1);
+	usleep(100);
+}
+
+static void
+record(void *ctxt)
+{
+	ran[(long)ctxt]++;
+}
+
+static dispatch_queue_t
+create_queue(size_t capacity, dispatch_queue_overflow_t overflow)
+{
+	dispatch_queue_attr_t attr;
+	dispatch_queue_t dq;
+
+	attr = dispatch_queue_attr_make_with_capacity(DISPATCH_QUEUE_SERIAL,
+			capacity, overflow);
+	test_ptr_notnull("dispatch_queue_attr_make_with_capacity", attr);
+	dq = dispatch_queue_create("com.example.capacity", attr);
+	test_ptr_notnull("dispatch_queue_create", dq);
+	dispatch_release(attr);
+	return dq;
+}
+
+static void
+test_fail(void)
+{
+	dispatch_queue_t dq = create_queue(CAPACITY, DISPATCH_QUEUE_OVERFLOW_FAIL);
+	long i, accepted = 0, rejected = 0;
+
+	dispatch_suspend(dq);
+	for (i = 0; i < COUNT; i++) {
+		if (dispatch_async_try_f(dq, (void *)i, record)) {
+			rejected++;
+		} else {
+			accepted++;
+		}
+	}
+	test_long("fail: accepted", accepted, CAPACITY);
+	test_long("fail: rejected", rejected, COUNT - CAPACITY);
+	dispatch_resume(dq);
+	dispatch_sync_f(dq, NULL, nop);
+	for (i = 0, accepted = 0; i < COUNT; i++) {
+		accepted += ran[i];
+		ran[i] = 0;
+	}
+	test_long("fail: invoked", accepted, CAPACITY);
+	test_long("fail: room after drain", dispatch_async_try_f(dq, NULL, nop), 0);
+	dispatch_sync_f(dq, NULL, nop);
+	dispatch_release(dq);
+}
+
+static void
+test_block(void)
+{
+	dispatch_queue_t dq = create_queue(CAPACITY, DISPATCH_QUEUE_OVERFLOW_BLOCK);
+	long i, pending;
+
+	for (i = 0; i < COUNT; i++) {
+		dispatch_async_f(dq, NULL, slow_work);
+		pending = ++submitted - started;
+		if (pending > max_pending) {
+			max_pending = pending;
+		}
+	}
+	dispatch_sync_f(dq, NULL, nop);
+	test_long("block: invoked", started, COUNT);
+	// the item being invoked is no longer pending but may not have started
+	test_long_less_than_or_equal("block: max pending", max_pending,
+			CAPACITY + 1);
+	dispatch_release(dq);
+}
+
+static void
+submit_from_subqueue(void *ctxt)
+{
+	dispatch_queue_t dq = ctxt;
+	long i;
+
+	for (i = 0; i < 10; i++) {
+		dispatch_async_f(dq, NULL, slow_work);
+	}
+}
+
+// Items of a queue targeting a full queue run on that queue, so they must
+// not block on it
+static void
+test_block_subqueue(void)
+{
+	dispatch_queue_t dq = create_queue(2, DISPATCH_QUEUE_OVERFLOW_BLOCK);
+	dispatch_queue_t sq = dispatch_queue_create("com.example.sub", NULL);
+	long i;
+
+	started = 0;
+	dispatch_set_target_queue(sq, dq);
+	dispatch_async_f(sq, dq, submit_from_subqueue);
+	for (i = 0; i < 1000 && started < 10; i++) {
+		usleep(10000);
+	}
+	test_long("block: invoked from subqueue", started, 10);
+	dispatch_release(sq);
+	dispatch_release(dq);
+}
+
+static void
+signal_sema(void *ctxt)
+{
+	dispatch_semaphore_signal(ctxt);
+}
+
+// Timers fire from the manager thread, which must not block on a full queue
+static void
+test_block_after(void)
+{
+	dispatch_queue_t dq = create_queue(2, DISPATCH_QUEUE_OVERFLOW_BLOCK);
+	dispatch_semaphore_t sema = dispatch_semaphore_create(0);
+	dispatch_time_t when;
+
+	dispatch_suspend(dq);
+	dispatch_async_f(dq, (void *)0, record);
+	dispatch_async_f(dq, (void *)1, record);
+	when = dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_MSEC);
+	dispatch_after_f(when, dq, (void *)2, record);
+	when = dispatch_time(DISPATCH_TIME_NOW, 50 * NSEC_PER_MSEC);
+	dispatch_after_f(when, dispatch_get_global_queue(0, 0), sema, signal_sema);
+	when = dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC);
+	test_long("block: timers fire while full",
+			dispatch_semaphore_wait(sema, when), 0);
+	dispatch_resume(dq);
+	dispatch_sync_f(dq, NULL, nop);
+	test_long("block: after invoked", ran[0] + ran[1] + ran[2], 3);
+	ran[0] = ran[1] = ran[2] = 0;
+	dispatch_release(sema);
+	dispatch_release(dq);
+}
+
+static void
+test_drop_oldest(void)
+{
+	dispatch_queue_t dq = create_queue(CAPACITY,
+			DISPATCH_QUEUE_OVERFLOW_DROP_OLDEST);
+	long i, invoked = 0, newest = 0;
+
+	dispatch_suspend(dq);
+	for (i = 0; i < COUNT; i++) {
+		dispatch_async_f(dq, (void *)i, record);
+	}
+	dispatch_resume(dq);
+	dispatch_sync_f(dq, NULL, nop);
+	for (i = 0; i < COUNT; i++) {
+		invoked += ran[i];
+		if (i >= COUNT - CAPACITY) {
+			newest += ran[i];
+		}
+	}
+	test_long("drop: invoked", invoked, CAPACITY);
+	test_long("drop: newest invoked", newest, CAPACITY);
+	dispatch_release(dq);
+}
+
+int
+main(void)
+{
+	dispatch_test_start("Dispatch Queue Capacity");
+
+	test_fail();
+	test_block();
+	test_block_subqueue();
+	test_block_after();
+	test_drop_oldest();
+
+	test_stop();
+
+	return 0;
+}
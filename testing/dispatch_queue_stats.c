@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+#include <config/config.h>
+
+#include <dispatch/dispatch.h>
+#include <dispatch/private.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+#define COUNT		100
+#define WORK_US		1000
+
+static void
+nop(void *ctxt __attribute__((unused)))
+{
+}
+
+static void
+work(void *ctxt __attribute__((unused)))
+{
+	usleep(WORK_US);
+}
+
+static long
+histogram_count(const uint64_t *buckets)
+{
+	long i, n = 0;
+
+	for (i = 0; i < DISPATCH_QUEUE_STATS_BUCKETS; i++) {
+		n += (long)buckets[i];
+	}
+	return n;
+}
+
+// Number of items in buckets of durations of at least ns nanoseconds
+static long
+histogram_count_above(const uint64_t *buckets, uint64_t ns)
+{
+	long i, n = 0;
+
+	for (i = 0; i < DISPATCH_QUEUE_STATS_BUCKETS; i++) {
+		if (i && (1ull << (i - 1)) >= ns) {
+			n += (long)buckets[i];
+		}
+	}
+	return n;
+}
+
+static void
+test_disabled(void)
+{
+	dispatch_queue_t dq = dispatch_queue_create("com.example.stats", NULL);
+	struct dispatch_queue_stats_s stats;
+
+	test_long("disabled: result",
+			dispatch_queue_get_stats(dq, &stats), ENOTSUP);
+	test_long("disabled: enqueued", (long)stats.enqueued, 0);
+	dispatch_release(dq);
+}
+
+static void
+test_serial(void)
+{
+	dispatch_queue_t dq = dispatch_queue_create("com.example.stats", NULL);
+	struct dispatch_queue_stats_s stats;
+	long i;
+
+	dispatch_queue_enable_stats(dq);
+	dispatch_suspend(dq);
+	for (i = 0; i < COUNT; i++) {
+		dispatch_async_f(dq, NULL, work);
+	}
+	test_long("serial: result", dispatch_queue_get_stats(dq, &stats), 0);
+	test_long("serial: pending depth", (long)stats.depth, COUNT);
+	test_long("serial: pending dequeued", (long)stats.dequeued, 0);
+
+	usleep(10 * WORK_US);
+	dispatch_resume(dq);
+	dispatch_sync_f(dq, NULL, nop);
+	(void)dispatch_queue_get_stats(dq, &stats);
+	test_long("serial: enqueued", (long)stats.enqueued, COUNT);
+	test_long("serial: dequeued", (long)stats.dequeued, COUNT);
+	test_long("serial: depth", (long)stats.depth, 0);
+	test_long("serial: latency samples", histogram_count(stats.latency),
+			COUNT);
+	test_long("serial: execution samples", histogram_count(stats.execution),
+			COUNT);
+	// the items waited for the queue to be resumed and sleep while invoked
+	test_long("serial: latency >= wait",
+			histogram_count_above(stats.latency, 5 * WORK_US * 1000ull / 8),
+			COUNT);
+	test_long("serial: execution >= sleep",
+			histogram_count_above(stats.execution, WORK_US * 1000ull / 2),
+			COUNT);
+	dispatch_release(dq);
+}
+
+static void
+test_concurrent(void)
+{
+	dispatch_queue_t dq = dispatch_queue_create("com.example.stats",
+			DISPATCH_QUEUE_CONCURRENT);
+	struct dispatch_queue_stats_s stats;
+	long i;
+
+	dispatch_queue_enable_stats(dq);
+	for (i = 0; i < COUNT; i++) {
+		dispatch_async_f(dq, NULL, nop);
+	}
+	dispatch_barrier_sync_f(dq, NULL, nop);
+	test_long("concurrent: result", dispatch_queue_get_stats(dq, &stats), 0);
+	test_long("concurrent: enqueued", (long)stats.enqueued, COUNT);
+	test_long("concurrent: dequeued", (long)stats.dequeued, COUNT);
+	test_long("concurrent: depth", (long)stats.depth, 0);
+	test_long("concurrent: latency samples", histogram_count(stats.latency),
+			COUNT);
+	dispatch_release(dq);
+}
+
+int
+main(void)
+{
+	dispatch_test_start("Dispatch Queue Statistics");
+
+	test_disabled();
+	test_serial();
+	test_concurrent();
+
+	test_stop();
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+#include <config/config.h>
+
+#include <dispatch/dispatch.h>
+#include <dispatch/private.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+// Weighted serial queues kept busy on a shared serial target queue must get
+// shares of the target proportional to their weights.
+
+#define QUEUES		3
+#define COUNT		20000
+#define WORK_USEC	20
+#define SAMPLE		5000 // work items, about 100ms of work
+#define TOLERANCE	0.05
+
+static const unsigned int weights[QUEUES] = { 1, 2, 4 };
+static dispatch_queue_t tq;
+static long counts[QUEUES], snapshot[QUEUES], total;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static void
+nop(void *ctxt __attribute__((unused)))
+{
+}
+
+static void
+check_shares(void *ctxt __attribute__((unused)))
+{
+	long i, weight_total = 0;
+
+	for (i = 0; i < QUEUES; i++) {
+		weight_total += weights[i];
+	}
+	for (i = 0; i < QUEUES; i++) {
+		double share = (double)snapshot[i] / SAMPLE;
+		double expected = (double)weights[i] / weight_total;
+
+		printf("weight %u: %ld items, share %.3f expected %.3f\n",
+				weights[i], snapshot[i], share, expected);
+		test_double_less_than("share deviation", share > expected ?
+				share - expected : expected - share, TOLERANCE);
+	}
+	test_stop();
+}
+
+static void
+work(void *ctxt)
+{
+	long i = (long)ctxt;
+	uint64_t until = now_ns() + WORK_USEC * NSEC_PER_USEC;
+
+	while (now_ns() < until);
+	counts[i]++;
+	// the target is serial, the counts cannot change while copying them
+	if (++total == SAMPLE) {
+		for (i = 0; i < QUEUES; i++) {
+			snapshot[i] = counts[i];
+		}
+		dispatch_async_f(dispatch_get_main_queue(), NULL, check_shares);
+	}
+}
+
+int
+main(void)
+{
+	dispatch_queue_attr_t attr;
+	dispatch_queue_t q[QUEUES];
+	long i, j;
+
+	dispatch_test_start("Dispatch Queue Weight");
+
+	tq = dispatch_queue_create("com.example.weight.target", NULL);
+	test_ptr_notnull("dispatch_queue_create", tq);
+	for (i = 0; i < QUEUES; i++) {
+		attr = dispatch_queue_attr_make_with_weight(DISPATCH_QUEUE_SERIAL,
+				weights[i]);
+		test_ptr_notnull("dispatch_queue_attr_make_with_weight", attr);
+		q[i] = dispatch_queue_create("com.example.weight", attr);
+		dispatch_release(attr);
+		dispatch_set_target_queue(q[i], tq);
+		// wait for the new target queue to be applied
+		dispatch_sync_f(q[i], NULL, nop);
+	}
+
+	// Queue the lightest queue first so that arrival order favors it
+	dispatch_suspend(tq);
+	for (i = 0; i < QUEUES; i++) {
+		for (j = 0; j < COUNT; j++) {
+			dispatch_async_f(q[i], (void *)i, work);
+		}
+		dispatch_release(q[i]);
+	}
+	dispatch_resume(tq);
+
+	dispatch_main();
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+#include <dispatch/dispatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+// Uses a semaphore as admission control for work items that wait for it
+// asynchronously, checks that the limit holds, that asynchronous waiters are
+// served in order and that they coexist with blocked threads.
+
+#define LIMIT		4
+#define ITEMS		10000
+#define ORDERED		64
+
+static dispatch_semaphore_t sema;
+static dispatch_group_t group;
+static long volatile active, max_active, ran;
+static long order[ORDERED];
+static long ordered;
+
+static void
+admitted(void *context __attribute__((unused)))
+{
+	long n = __sync_add_and_fetch(&active, 1), m;
+
+	while ((m = max_active) < n) {
+		(void)__sync_bool_compare_and_swap(&max_active, m, n);
+	}
+	if (!(__sync_add_and_fetch(&ran, 1) % 64)) {
+		usleep(100);
+	}
+	(void)__sync_sub_and_fetch(&active, 1);
+	dispatch_semaphore_signal(sema);
+	dispatch_group_leave(group);
+}
+
+static void
+in_order(void *context)
+{
+	order[ordered++] = (long)context;
+	dispatch_group_leave(group);
+}
+
+static void *
+blocked(void *context __attribute__((unused)))
+{
+	long i;
+
+	for (i = 0; i < ITEMS / 10; i++) {
+		dispatch_semaphore_wait(sema, DISPATCH_TIME_FOREVER);
+		(void)__sync_add_and_fetch(&ran, 1);
+		dispatch_semaphore_signal(sema);
+	}
+	return NULL;
+}
+
+static void
+test_admission(void)
+{
+	dispatch_queue_t q = dispatch_get_global_queue(0, 0);
+	pthread_t thread;
+	long i, failures = 0;
+	int r;
+
+	sema = dispatch_semaphore_create(LIMIT);
+	group = dispatch_group_create();
+	r = pthread_create(&thread, NULL, blocked, NULL);
+	assert(r == 0);
+	for (i = 0; i < ITEMS; i++) {
+		dispatch_group_enter(group);
+		dispatch_semaphore_wait_async_f(sema, q, NULL, admitted);
+	}
+	test_long("admission complete", dispatch_group_wait(group,
+			dispatch_time(DISPATCH_TIME_NOW, 30 * NSEC_PER_SEC)), 0);
+	r = pthread_join(thread, NULL);
+	assert(r == 0);
+	test_long("items admitted", ran, ITEMS + ITEMS / 10);
+	test_long_less_than_or_equal("maximum concurrency", max_active, LIMIT);
+	// all permits must be available again
+	for (i = 0; i < LIMIT; i++) {
+		failures += dispatch_semaphore_wait(sema, DISPATCH_TIME_NOW) != 0;
+	}
+	test_long("permits returned", failures, 0);
+	test_long_greater_than_or_equal("no extra permit",
+			labs(dispatch_semaphore_wait(sema, DISPATCH_TIME_NOW)), 1);
+	for (i = 0; i < LIMIT; i++) {
+		dispatch_semaphore_signal(sema);
+	}
+
+	dispatch_release(group);
+	dispatch_release(sema);
+}
+
+static void
+test_order(void)
+{
+	dispatch_queue_t q = dispatch_queue_create("com.example.order", NULL);
+	long i, handed_over = 0, in_sequence = 0;
+
+	sema = dispatch_semaphore_create(0);
+	group = dispatch_group_create();
+	for (i = 0; i < ORDERED; i++) {
+		dispatch_group_enter(group);
+		dispatch_semaphore_wait_async_f(sema, q, (void *)i, in_order);
+	}
+	// the waiters hold the semaphore and queue alive
+	dispatch_retain(sema);
+	dispatch_release(q);
+	usleep(10000);
+	test_long("nothing submitted before signal", ordered, 0);
+	for (i = 0; i < ORDERED; i++) {
+		handed_over += dispatch_semaphore_signal(sema) != 0;
+	}
+	test_long("signals handed over", handed_over, ORDERED);
+	test_long("ordered complete", dispatch_group_wait(group,
+			dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+	for (i = 0; i < ORDERED; i++) {
+		in_sequence += order[i] == i;
+	}
+	test_long("FIFO order", in_sequence, ORDERED);
+
+	dispatch_release(sema);
+	dispatch_release(sema);
+	dispatch_release(group);
+}
+
+int
+main(void)
+{
+	dispatch_test_start("Dispatch Semaphore Async Wait");
+
+	test_admission();
+	test_order();
+
+	test_stop();
+
+	return 0;
+}
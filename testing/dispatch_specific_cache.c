@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+#include <config/config.h>
+
+#include <dispatch/dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+// dispatch_get_specific() caches its last result per thread, check that the
+// cache follows changes of contexts and of target queues.
+
+#define LOOKUPS 100000
+#define KEYS 32
+
+static char key1, key2;
+static char *ctxts[] = {"ctxt 1", "ctxt 1 bis", "ctxt 2 on target",
+		"ctxt 2 on other target"};
+static dispatch_queue_t q, tq, otq;
+static long destroyed;
+
+static void
+destructor(void *ctxt __attribute__((unused)))
+{
+	(void)__sync_add_and_fetch(&destroyed, 1);
+}
+
+static void
+check_lookups(void *ctxt __attribute__((unused)))
+{
+	long i, hits = 0;
+
+	test_ptr("key 1", dispatch_get_specific(&key1), ctxts[0]);
+	test_ptr("key 2 on target queue", dispatch_get_specific(&key2), ctxts[2]);
+	for (i = 0; i < LOOKUPS; i++) {
+		hits += dispatch_get_specific(&key1) == ctxts[0];
+	}
+	test_long("repeated lookups", hits, LOOKUPS);
+
+	dispatch_queue_set_specific(q, &key1, ctxts[1], destructor);
+	test_ptr("key 1 after set", dispatch_get_specific(&key1), ctxts[1]);
+	test_ptr("key 1 from queue", dispatch_queue_get_specific(q, &key1),
+			ctxts[1]);
+	dispatch_queue_set_specific(q, &key1, NULL, NULL);
+	test_ptr("key 1 after removal", dispatch_get_specific(&key1), NULL);
+	test_ptr("key 2 still on target queue", dispatch_get_specific(&key2),
+			ctxts[2]);
+}
+
+static void
+check_retarget(void *ctxt __attribute__((unused)))
+{
+	test_ptr("key 2 on other target queue", dispatch_get_specific(&key2),
+			ctxts[3]);
+	test_ptr("key 1 removed", dispatch_get_specific(&key1), NULL);
+}
+
+static void
+check_outside(void *ctxt __attribute__((unused)))
+{
+	test_ptr("key 2 outside of the queue", dispatch_get_specific(&key2), NULL);
+}
+
+// Keys added past the initial room of a queue, removed and set again
+static void
+test_many_keys(void)
+{
+	dispatch_queue_t mq = dispatch_queue_create("com.example.specific.many",
+			NULL);
+	static char keys[KEYS];
+	long i, found;
+
+	for (i = 0; i < KEYS; i++) {
+		dispatch_queue_set_specific(mq, &keys[i], &keys[i], NULL);
+	}
+	for (i = 0, found = 0; i < KEYS; i++) {
+		found += dispatch_queue_get_specific(mq, &keys[i]) == &keys[i];
+	}
+	test_long("many keys", found, KEYS);
+	for (i = 0; i < KEYS; i += 2) {
+		dispatch_queue_set_specific(mq, &keys[i], NULL, NULL);
+	}
+	for (i = 0, found = 0; i < KEYS; i++) {
+		found += dispatch_queue_get_specific(mq, &keys[i]) != NULL;
+	}
+	test_long("many keys after removal", found, KEYS / 2);
+	dispatch_queue_set_specific(mq, &keys[0], ctxts[0], NULL);
+	test_ptr("key set again", dispatch_queue_get_specific(mq, &keys[0]),
+			ctxts[0]);
+	dispatch_release(mq);
+}
+
+int
+main(void)
+{
+	long i;
+
+	dispatch_test_start("Dispatch Queue Specific Cache");
+
+	q = dispatch_queue_create("com.example.specific", NULL);
+	tq = dispatch_queue_create("com.example.specific.target", NULL);
+	otq = dispatch_queue_create("com.example.specific.other-target", NULL);
+
+	dispatch_queue_set_specific(q, &key1, ctxts[0], destructor);
+	dispatch_queue_set_specific(tq, &key2, ctxts[2], NULL);
+	dispatch_queue_set_specific(otq, &key2, ctxts[3], NULL);
+	test_ptr("key 1 before use", dispatch_queue_get_specific(q, &key1),
+			ctxts[0]);
+	test_ptr("key 2 not on queue", dispatch_queue_get_specific(q, &key2),
+			NULL);
+
+	dispatch_set_target_queue(q, tq);
+	dispatch_sync_f(q, NULL, check_lookups);
+	dispatch_set_target_queue(q, otq);
+	dispatch_sync_f(q, NULL, check_retarget);
+	dispatch_sync_f(dispatch_get_global_queue(0, 0), NULL, check_outside);
+	test_many_keys();
+
+	dispatch_release(q);
+	dispatch_release(tq);
+	dispatch_release(otq);
+	// the replaced context and the removed one, destroyed asynchronously
+	for (i = 0; i < 1000 && destroyed < 2; i++) {
+		usleep(1000);
+	}
+	test_long("destructors", destroyed, 2);
+
+	test_stop();
+
+	return 0;
+}
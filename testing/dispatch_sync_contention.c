@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+#include <config/config.h>
+
+#if HAVE_MACH
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#endif
+#include <dispatch/dispatch.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+// Compares the latency of a short critical section guarded by a serial queue
+// with dispatch_sync against the same section guarded by a pthread mutex,
+// with several threads contending for it.
+
+#define THREADS		4ul
+#define ITERATIONS	100000ul
+#define WORK		50ul // iterations of the critical section
+#define ACCEPTABLE_LATENCY_NS 20000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static dispatch_queue_t q;
+static unsigned long volatile counter, scratch;
+#if HAVE_MACH
+static mach_timebase_info_data_t tbi;
+#endif
+
+static uint64_t
+elapsed_ns(uint64_t since)
+{
+	uint64_t delta = _dispatch_monotonic_time() - since;
+#if HAVE_MACH
+	delta *= tbi.numer;
+	delta /= tbi.denom;
+#endif
+	return delta;
+}
+
+static void
+critical_section(void *context __attribute__((unused)))
+{
+	unsigned long i;
+
+	for (i = 0; i < WORK; i++) {
+		scratch++;
+	}
+	counter++;
+}
+
+static void *
+mutex_thread(void *context __attribute__((unused)))
+{
+	unsigned long i;
+
+	for (i = 0; i < ITERATIONS; i++) {
+		pthread_mutex_lock(&lock);
+		critical_section(NULL);
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+static void *
+sync_thread(void *context __attribute__((unused)))
+{
+	unsigned long i;
+
+	for (i = 0; i < ITERATIONS; i++) {
+		dispatch_sync_f(q, NULL, critical_section);
+	}
+	return NULL;
+}
+
+static uint64_t
+contend(const char *name, void *(*fn)(void *))
+{
+	pthread_t threads[THREADS];
+	uint64_t start, delta;
+	unsigned long i;
+	int r;
+
+	counter = 0;
+	start = _dispatch_monotonic_time();
+	for (i = 0; i < THREADS; i++) {
+		r = pthread_create(&threads[i], NULL, fn, NULL);
+		assert(r == 0);
+	}
+	for (i = 0; i < THREADS; i++) {
+		r = pthread_join(threads[i], NULL);
+		assert(r == 0);
+	}
+	delta = elapsed_ns(start) / (THREADS * ITERATIONS);
+
+	printf("%s: %"PRIu64" ns / critical section\n", name, delta);
+	test_long(name, (long)counter, (long)(THREADS * ITERATIONS));
+	return delta;
+}
+
+int
+main(void)
+{
+	uint64_t mutex_ns, sync_ns;
+
+	dispatch_test_start("Dispatch Sync Contention");
+#if HAVE_MACH
+	kern_return_t kr = mach_timebase_info(&tbi);
+	assert(kr == 0);
+#endif
+
+	q = dispatch_queue_create("com.example.sync-contention", NULL);
+	test_ptr_notnull("dispatch_queue_create", q);
+
+	mutex_ns = contend("pthread_mutex", mutex_thread);
+	sync_ns = contend("dispatch_sync", sync_thread);
+	printf("ratio: %.2f\n", mutex_ns ? (double)sync_ns / mutex_ns : 0.0);
+
+	test_long_less_than("dispatch_sync latency (ns)", (long)sync_ns,
+			ACCEPTABLE_LATENCY_NS);
+
+	dispatch_release(q);
+	test_stop();
+
+	return 0;
+}
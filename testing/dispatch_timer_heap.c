@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2008-2011 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+#include <config/config.h>
+
+#if HAVE_MACH
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#endif
+#include <dispatch/dispatch.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <bsdtests.h>
+#include "dispatch_test.h"
+
+// Arms a large number of one-shot timers in scrambled deadline order and
+// measures how long it takes to arm them and how late the last one fires.
+// With sorted timer lists arming is quadratic in the number of timers.
+
+#define COUNT		100000ul
+#define STRIDE		7919ul // prime, scrambles the deadline order
+#define DELAY		(500ull * NSEC_PER_MSEC)
+#define SPAN		(1ull * NSEC_PER_SEC)
+#define ACCEPTABLE_LATENCY_MS 5000
+
+static dispatch_source_t timers[COUNT];
+static size_t count_down = COUNT;
+static uint64_t start, armed;
+#if HAVE_MACH
+static mach_timebase_info_data_t tbi;
+#endif
+
+static uint64_t
+elapsed_ns(uint64_t since)
+{
+	uint64_t delta = _dispatch_monotonic_time() - since;
+#if HAVE_MACH
+	delta *= tbi.numer;
+	delta /= tbi.denom;
+#endif
+	return delta;
+}
+
+static void
+collect(void *context __attribute__((unused)))
+{
+	uint64_t delta = elapsed_ns(start);
+	long late_ms = 0;
+
+	if (delta > DELAY + SPAN) {
+		late_ms = (long)((delta - DELAY - SPAN) / NSEC_PER_MSEC);
+	}
+
+	printf("count: %lu\n", COUNT);
+	printf("arm: %"PRIu64" ns (%"PRIu64" ns / timer)\n", armed,
+			armed / COUNT);
+	printf("delta: %"PRIu64" ns\n", delta);
+
+	test_long("Timers fired", (long)(COUNT - count_down), (long)COUNT);
+	test_long_less_than("Last timer latency (ms)", late_ms,
+			ACCEPTABLE_LATENCY_MS);
+	test_stop();
+}
+
+static void
+fire(void *context)
+{
+	dispatch_source_t ds = timers[(size_t)context];
+
+	dispatch_source_cancel(ds);
+	if (!--count_down) {
+		dispatch_async_f(dispatch_get_main_queue(), NULL, collect);
+	}
+}
+
+static void
+cancel(void *context)
+{
+	dispatch_release(timers[(size_t)context]);
+}
+
+int
+main(void)
+{
+	dispatch_queue_t q;
+	dispatch_time_t base;
+	size_t i, slot;
+
+	dispatch_test_start("Dispatch Timer Heap");
+#if HAVE_MACH
+	kern_return_t kr = mach_timebase_info(&tbi);
+	assert(kr == 0);
+#endif
+
+	q = dispatch_queue_create("com.example.timer-heap", NULL);
+
+	start = _dispatch_monotonic_time();
+	base = dispatch_time(DISPATCH_TIME_NOW, (int64_t)DELAY);
+	for (i = 0; i < COUNT; i++) {
+		slot = (i * STRIDE) % COUNT;
+		timers[i] = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, q);
+		assert(timers[i]);
+		dispatch_set_context(timers[i], (void *)i);
+		dispatch_source_set_event_handler_f(timers[i], fire);
+		dispatch_source_set_cancel_handler_f(timers[i], cancel);
+		dispatch_source_set_timer(timers[i],
+				dispatch_time(base, (int64_t)(slot * (SPAN / COUNT))),
+				DISPATCH_TIME_FOREVER, 0);
+		dispatch_resume(timers[i]);
+	}
+	armed = elapsed_ns(start);
+	dispatch_release(q);
+
+	dispatch_main();
+}